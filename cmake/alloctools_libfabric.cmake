@@ -51,11 +51,11 @@ endif()
 # Memory chunk/reservation options
 #------------------------------------------------------------------------------
 alloctools_option(ALLOCTOOLS_TINY_MEMORY_CHUNK_SIZE STRING
-  "Number of bytes a tiny chunk in the memory pool can hold (default: 1K)"
+  "Default chunk size of the smallest memory pool size class, a power of 2 (default: 4096)"
   "4096" CATEGORY "alloctools" ADVANCED)
 
 alloctools_option(ALLOCTOOLS_64K_PAGES STRING
-  "Number of 64K pages we reserve for default message buffers (default: 10)"
+  "Default number of 64K pages reserved for each memory pool size class (default: 10)"
   "10" CATEGORY "alloctools" ADVANCED)
 
 alloctools_add_config_define_namespace(
@@ -68,6 +68,79 @@ alloctools_add_config_define_namespace(
     VALUE     ${ALLOCTOOLS_64K_PAGES}
     NAMESPACE alloctools)
 
+#------------------------------------------------------------------------------
+# Thread local caching of memory regions
+#------------------------------------------------------------------------------
+alloctools_option(ALLOCTOOLS_WITH_THREAD_CACHE BOOL
+  "Enable per thread magazines of regions in front of the memory pool stacks (default: OFF)"
+  OFF CATEGORY "alloctools" ADVANCED)
+
+alloctools_option(ALLOCTOOLS_THREAD_CACHE_SIZE STRING
+  "Number of regions each thread may cache per memory pool stack (default: 32)"
+  "32" CATEGORY "alloctools" ADVANCED)
+
+if (ALLOCTOOLS_WITH_THREAD_CACHE)
+  alloctools_add_config_define_namespace(
+      DEFINE    ALLOCTOOLS_HAVE_THREAD_CACHE
+      NAMESPACE alloctools)
+  alloctools_add_config_define_namespace(
+      DEFINE    ALLOCTOOLS_THREAD_CACHE_SIZE
+      VALUE     ${ALLOCTOOLS_THREAD_CACHE_SIZE}
+      NAMESPACE alloctools)
+endif()
+
+#------------------------------------------------------------------------------
+# Latency histograms of memory pool operations
+#------------------------------------------------------------------------------
+alloctools_option(ALLOCTOOLS_WITH_LATENCY_HISTOGRAMS BOOL
+  "Record latency histograms of memory pool allocation, release, growth and registration (default: OFF)"
+  OFF CATEGORY "alloctools" ADVANCED)
+
+if (ALLOCTOOLS_WITH_LATENCY_HISTOGRAMS)
+  alloctools_add_config_define_namespace(
+      DEFINE    ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+      NAMESPACE alloctools)
+endif()
+
+#------------------------------------------------------------------------------
+# Message length and internal fragmentation statistics of the size classes
+#------------------------------------------------------------------------------
+alloctools_option(ALLOCTOOLS_WITH_FRAGMENTATION_STATS BOOL
+  "Record the message lengths of memory pool chunks when they are released (default: OFF)"
+  OFF CATEGORY "alloctools" ADVANCED)
+
+if (ALLOCTOOLS_WITH_FRAGMENTATION_STATS)
+  alloctools_add_config_define_namespace(
+      DEFINE    ALLOCTOOLS_HAVE_FRAGMENTATION_STATS
+      NAMESPACE alloctools)
+endif()
+
+#------------------------------------------------------------------------------
+# Tracking of memory pool chunks that have not been returned (leaks)
+#------------------------------------------------------------------------------
+alloctools_option(ALLOCTOOLS_WITH_REGION_TRACKING BOOL
+  "Track the age and call site of every allocated memory pool chunk (default: OFF)"
+  OFF CATEGORY "alloctools" ADVANCED)
+
+if (ALLOCTOOLS_WITH_REGION_TRACKING)
+  alloctools_add_config_define_namespace(
+      DEFINE    ALLOCTOOLS_HAVE_REGION_TRACKING
+      NAMESPACE alloctools)
+endif()
+
+#------------------------------------------------------------------------------
+# Sampling heap profiler of memory pool allocations
+#------------------------------------------------------------------------------
+alloctools_option(ALLOCTOOLS_WITH_HEAP_PROFILER BOOL
+  "Enable a sampling profiler that attributes memory pool regions to call stacks (default: OFF)"
+  OFF CATEGORY "alloctools" ADVANCED)
+
+if (ALLOCTOOLS_WITH_HEAP_PROFILER)
+  alloctools_add_config_define_namespace(
+      DEFINE    ALLOCTOOLS_HAVE_HEAP_PROFILER
+      NAMESPACE alloctools)
+endif()
+
 #------------------------------------------------------------------------------
 # Write options to file in build dir
 #------------------------------------------------------------------------------
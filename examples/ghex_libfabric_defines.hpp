@@ -0,0 +1,22 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+// --------------------------------------------------------------------
+// the project that embeds alloctools (GHEX) normally provides this header,
+// the examples are built on their own and only need the macros used by
+// the debugging utilities
+// --------------------------------------------------------------------
+#ifndef HPX_NON_COPYABLE
+#define HPX_NON_COPYABLE(cls)                                                  \
+    cls(cls const&) = delete;                                                  \
+    cls& operator=(cls const&) = delete
+#endif
@@ -0,0 +1,94 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+namespace alloctools { namespace examples {
+
+    // --------------------------------------------------------------------
+    // A region provider that registers nothing, so that the pools can be
+    // exercised without a network. It counts the bytes that are currently
+    // registered, for comparison with what the pool reports.
+    // --------------------------------------------------------------------
+    struct mock_provider
+    {
+        struct provider_region
+        {
+            void* address_;
+            std::size_t length_;
+            std::uint64_t key_;
+        };
+
+        struct provider_domain
+        {
+        };
+
+        static int register_memory(provider_domain*, const void* buf,
+            std::size_t len, std::uint64_t, std::uint64_t, std::uint64_t,
+            std::uint64_t, provider_region** region, void*)
+        {
+            static std::atomic<std::uint64_t> next_key(1);
+            *region = new provider_region{const_cast<void*>(buf), len, next_key++};
+            registered_bytes() += std::int64_t(len);
+            return 0;
+        }
+
+        static int unregister_memory(provider_region* region)
+        {
+            registered_bytes() -= std::int64_t(region->length_);
+            delete region;
+            return 0;
+        }
+
+        static int flags()
+        {
+            return 0;
+        }
+
+        static void* get_local_key(provider_region* region)
+        {
+            return region->address_;
+        }
+
+        static std::uint64_t get_remote_key(provider_region* region)
+        {
+            return region->key_;
+        }
+
+        static std::atomic<std::int64_t>& registered_bytes()
+        {
+            static std::atomic<std::int64_t> bytes(0);
+            return bytes;
+        }
+    };
+
+    // --------------------------------------------------------------------
+    // checks that stay enabled in release builds, a failure ends the example
+    // --------------------------------------------------------------------
+    inline void check(bool ok, const char* what, const char* file, int line)
+    {
+        if (!ok)
+        {
+            std::cerr << file << ":" << line << ": check failed: " << what
+                      << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+}}    // namespace alloctools::examples
+
+#define ALLOCTOOLS_CHECK(expr)                                                 \
+    alloctools::examples::check((expr), #expr, __FILE__, __LINE__)
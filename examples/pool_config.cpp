@@ -0,0 +1,82 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include "mock_provider.hpp"
+//
+#include <alloctools/memory_pool.hpp>
+//
+#include <iostream>
+#include <stdexcept>
+
+using namespace alloctools::rma;
+using alloctools::examples::mock_provider;
+using pool_type = memory_pool<mock_provider>;
+
+// --------------------------------------------------------------------
+// a pool can only be created from a valid size_class_config
+// --------------------------------------------------------------------
+bool rejected(size_class_config const& config)
+{
+    mock_provider::provider_domain domain;
+    try
+    {
+        pool_type pool(&domain, config);
+    }
+    catch (std::invalid_argument const& e)
+    {
+        std::cout << "rejected: " << e.what() << "\n";
+        return true;
+    }
+    return false;
+}
+
+int main()
+{
+    size_class_config config;
+    config.min_chunk_size = 4096;
+    config.max_chunk_size = 0x10000;
+    config.initial_bytes = 0x10000;
+
+    size_class_config c = config;
+    c.min_chunk_size = 3000;
+    ALLOCTOOLS_CHECK(rejected(c));
+
+    c = config;
+    c.max_chunk_size = 2048;
+    ALLOCTOOLS_CHECK(rejected(c));
+
+    c = config;
+    c.min_chunks = 0;
+    ALLOCTOOLS_CHECK(rejected(c));
+
+    c = config;
+    c.small_object_max_size = 8192;
+    ALLOCTOOLS_CHECK(rejected(c));
+
+    // a valid config
+    {
+        mock_provider::provider_domain domain;
+        pool_type pool(&domain, config);
+        ALLOCTOOLS_CHECK(pool.size_classes().size() == 5);
+        // every class reserves initial_bytes, but at least min_chunks (4)
+        // chunks: 64K for the 4K, 8K and 16K classes, 128K and 256K above
+        ALLOCTOOLS_CHECK(pool.registered_bytes() == 3 * 0x10000 + 0x20000 + 0x40000);
+        ALLOCTOOLS_CHECK(
+            mock_provider::registered_bytes() == std::int64_t(pool.registered_bytes()));
+        memory_region* region = pool.allocate_region(5000);
+        ALLOCTOOLS_CHECK(region->get_size() == 8192);
+        ALLOCTOOLS_CHECK(!region->get_temp_region());
+        pool.deallocate(region);
+    }
+    ALLOCTOOLS_CHECK(mock_provider::registered_bytes() == 0);
+
+    std::cout << "pool_config OK" << std::endl;
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include "mock_provider.hpp"
+//
+#include <alloctools/memory_pool.hpp>
+//
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace alloctools::rma;
+using alloctools::examples::mock_provider;
+using pool_type = memory_pool<mock_provider>;
+
+// --------------------------------------------------------------------
+// threads allocate and release regions of all size classes (singly and in
+// batches) while the main thread keeps trimming the pool. Each region is
+// filled with a pattern of its owner, which must be intact on release
+// --------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+    const int num_threads = (argc > 1) ? std::atoi(argv[1]) : 4;
+    const int iterations = (argc > 2) ? std::atoi(argv[2]) : 20000;
+
+    size_class_config config;
+    config.min_chunk_size = 256;
+    config.max_chunk_size = 0x10000;
+    config.initial_bytes = 0x10000;
+
+    mock_provider::provider_domain domain;
+    {
+        pool_type pool(&domain, config);
+        std::atomic<int> running(num_threads);
+        std::atomic<int> corrupted(0);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                const unsigned char pattern = static_cast<unsigned char>(t + 1);
+                std::vector<memory_region*> held;
+                memory_region* batch[8];
+                for (int i = 0; i < iterations; ++i)
+                {
+                    std::size_t length = std::size_t(100) << ((i + t) % 10);
+                    if (i % 16 == 0)
+                    {
+                        pool.allocate_regions(8, length, batch);
+                        pool.release_regions(batch, 8);
+                    }
+                    memory_region* region = pool.allocate_region(length);
+                    std::memset(region->get_address(), pattern, length);
+                    region->set_message_length(uint32_t(length));
+                    held.push_back(region);
+                    if (held.size() > 16)
+                    {
+                        // release the oldest half
+                        for (std::size_t j = 0; j < 8; ++j)
+                        {
+                            memory_region* r = held[j];
+                            const unsigned char* p =
+                                reinterpret_cast<unsigned char*>(r->get_address());
+                            for (uint32_t k = 0; k < r->get_message_length(); ++k)
+                            {
+                                if (p[k] != pattern)
+                                {
+                                    ++corrupted;
+                                    break;
+                                }
+                            }
+                            pool.deallocate(r);
+                        }
+                        held.erase(held.begin(), held.begin() + 8);
+                    }
+                }
+                for (auto region : held)
+                {
+                    pool.deallocate(region);
+                }
+                --running;
+            });
+        }
+
+        while (running.load() > 0)
+        {
+            pool.trim(config.initial_bytes);
+            std::this_thread::yield();
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        ALLOCTOOLS_CHECK(corrupted == 0);
+        auto stats = pool.statistics();
+        for (auto const& c : stats.classes)
+        {
+            ALLOCTOOLS_CHECK(c.used_chunks == 0);
+        }
+        ALLOCTOOLS_CHECK(stats.temp_regions == 0);
+        ALLOCTOOLS_CHECK(std::int64_t(pool.registered_bytes()) ==
+            mock_provider::registered_bytes());
+    }
+    ALLOCTOOLS_CHECK(mock_provider::registered_bytes() == 0);
+
+    std::cout << "pool_stress OK" << std::endl;
+    return 0;
+}
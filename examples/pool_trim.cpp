@@ -0,0 +1,99 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#include "mock_provider.hpp"
+//
+#include <alloctools/memory_pool.hpp>
+//
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using namespace alloctools::rma;
+using alloctools::examples::mock_provider;
+using pool_type = memory_pool<mock_provider>;
+
+// --------------------------------------------------------------------
+// grow a pool, trim it to nothing and grow it again, the registered bytes
+// reported by the pool must always match what the provider has registered
+// --------------------------------------------------------------------
+int main()
+{
+    size_class_config config;
+    config.min_chunk_size = 4096;
+    config.max_chunk_size = 4096;
+    config.initial_bytes = 4 * 4096;
+    config.min_chunks = 4;
+
+    mock_provider::provider_domain domain;
+    {
+        pool_type pool(&domain, config);
+        auto registered = [&pool]() {
+            return std::int64_t(pool.registered_bytes()) ==
+                mock_provider::registered_bytes();
+        };
+        ALLOCTOOLS_CHECK(pool.registered_bytes() == 4 * 4096);
+        ALLOCTOOLS_CHECK(registered());
+
+        // grow: the stack is grown by its high watermark when it runs dry
+        pool.set_watermarks(0, 0, 64);
+        std::vector<memory_region*> regions;
+        for (int i = 0; i < 64; ++i)
+        {
+            regions.push_back(pool.allocate_region(100));
+            ALLOCTOOLS_CHECK(!regions.back()->get_temp_region());
+        }
+        ALLOCTOOLS_CHECK(pool.registered_bytes() >= 64 * 4096);
+        ALLOCTOOLS_CHECK(registered());
+
+        // nothing can be trimmed while every chunk is in use
+        ALLOCTOOLS_CHECK(pool.trim(0) == 0);
+        for (auto region : regions)
+        {
+            pool.deallocate(region);
+        }
+        regions.clear();
+
+        // trim: every slab is free now
+        std::size_t before = pool.registered_bytes();
+        ALLOCTOOLS_CHECK(pool.trim(0) == before);
+        ALLOCTOOLS_CHECK(pool.registered_bytes() == 0);
+        ALLOCTOOLS_CHECK(registered());
+
+        // regrow: the slabs are rebuilt (reusing released descriptors) and
+        // every registered byte is accounted for
+        for (int round = 0; round < 3; ++round)
+        {
+            for (int i = 0; i < 64 * (round + 1); ++i)
+            {
+                regions.push_back(pool.allocate_region(100));
+                ALLOCTOOLS_CHECK(!regions.back()->get_temp_region());
+            }
+            ALLOCTOOLS_CHECK(pool.registered_bytes() >= regions.size() * 4096);
+            ALLOCTOOLS_CHECK(registered());
+            for (auto region : regions)
+            {
+                pool.deallocate(region);
+            }
+            regions.clear();
+            pool.trim(0);
+            ALLOCTOOLS_CHECK(pool.registered_bytes() == 0);
+            ALLOCTOOLS_CHECK(registered());
+        }
+
+        auto stats = pool.statistics();
+        std::cout << "grown " << stats.classes[0].grow_count << " released "
+                  << stats.classes[0].slab_releases << " slabs" << std::endl;
+    }
+    ALLOCTOOLS_CHECK(mock_provider::registered_bytes() == 0);
+
+    std::cout << "pool_trim OK" << std::endl;
+    return 0;
+}
@@ -17,10 +17,13 @@ namespace alloctools { namespace rma {
 
     // fancy pointer that embeds a memory_region
     template <typename T>
-    struct memory_region_pointer
+    struct memory_region_pointer;
 
-    // allocator that returns fancy pointers
-    template <typename T>
+    // abstract base of all memory pools
+    struct memory_pool_base;
+
+    // allocator that returns fancy pointers (from a given pool)
+    template <typename T, typename Pool = memory_pool_base>
     struct memory_region_allocator;
 
     // a memory pool
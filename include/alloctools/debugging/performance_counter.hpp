@@ -13,6 +13,7 @@
 #include "ghex_libfabric_defines.hpp"
 //
 #include <atomic>
+#include <cstddef>
 #include <type_traits>
 #include <iostream>
 
@@ -22,6 +23,11 @@
 #  define PERFORMANCE_COUNTER_ENABLED false
 #endif
 
+// the number of cache line sized slots of a sharded counter (power of two)
+#ifndef ALLOCTOOLS_COUNTER_SHARDS
+#  define ALLOCTOOLS_COUNTER_SHARDS 16
+#endif
+
 //
 // This class is intended to provide a simple atomic counter that can be used as a
 // performance counter, but that can be disabled at compile time so that it
@@ -113,4 +119,106 @@ namespace debug
             return os;
         }
     };
+
+    // --------------------------------------------------------------------
+    // the shard used by the calling thread, threads are given shards round
+    // robin when they first use a counter
+    inline std::size_t counter_shard()
+    {
+        static std::atomic<std::size_t> next{0};
+        static thread_local std::size_t shard =
+            next.fetch_add(1, std::memory_order_relaxed) &
+            (ALLOCTOOLS_COUNTER_SHARDS - 1);
+        return shard;
+    }
+
+    // --------------------------------------------------------------------
+    // A drop in replacement for performance_counter for counters that are
+    // updated by many threads. The value is spread over cache line sized
+    // shards, each thread updates its own shard (shared with other threads
+    // only when there are more threads than shards) and reading the counter
+    // sums the shards. Operators return the value of the caller's shard,
+    // not the total, reads of the total are not atomic with respect to
+    // concurrent updates. T should be unsigned, so that shards may wrap
+    // when a value is added on one shard and subtracted on another.
+    template <typename T,
+        bool enabled=PERFORMANCE_COUNTER_ENABLED,
+        typename Enable = enable_if_t<std::is_integral<T>::value>
+    >
+    struct sharded_counter {};
+
+    // --------------------------------------------------------------------
+    // specialization for sharded counters Enabled
+    template <typename T>
+    struct sharded_counter<T, true>
+    {
+        static_assert((ALLOCTOOLS_COUNTER_SHARDS & (ALLOCTOOLS_COUNTER_SHARDS - 1)) == 0,
+            "ALLOCTOOLS_COUNTER_SHARDS must be a power of two");
+
+        sharded_counter() { store(T()); }
+
+        sharded_counter(const T& init) { store(init); }
+
+        inline operator T() const
+        {
+            T total = T();
+            for (auto const& shard : shards_)
+            {
+                total += shard.value_.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        inline T operator=(const T& x) { store(x); return x; }
+
+        inline T operator++() { return add(T(1)); }
+
+        inline T operator++(int x) { return add(T(x)); }
+
+        inline T operator+=(const T& rhs) { return add(rhs); }
+
+        inline T operator--() { return add(T(0) - T(1)); }
+
+        inline T operator--(int x) { return add(T(0) - T(x)); }
+
+        inline T operator-=(const T& rhs) { return add(T(0) - rhs); }
+
+        friend std::ostream& operator<<(std::ostream& os,
+            const sharded_counter<T, true>& x)
+        {
+            os << T(x);
+            return os;
+        }
+
+    private:
+        inline T add(const T& x)
+        {
+            return shards_[counter_shard()].value_.fetch_add(
+                       x, std::memory_order_relaxed) + x;
+        }
+
+        void store(const T& x)
+        {
+            for (auto& shard : shards_)
+            {
+                shard.value_.store(T(), std::memory_order_relaxed);
+            }
+            shards_[0].value_.store(x, std::memory_order_relaxed);
+        }
+
+        struct alignas(64) shard
+        {
+            std::atomic<T> value_;
+        };
+        shard shards_[ALLOCTOOLS_COUNTER_SHARDS];
+    };
+
+    // --------------------------------------------------------------------
+    // specialization for sharded counters Disabled
+    template <typename T>
+    struct sharded_counter<T, false> : performance_counter<T, false>
+    {
+        using performance_counter<T, false>::performance_counter;
+        using performance_counter<T, false>::operator=;
+    };
 }}
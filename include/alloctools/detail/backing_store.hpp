@@ -0,0 +1,234 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+#include <alloctools/detail/numa_topology.hpp>
+//
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__linux) || defined(linux) || defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define ALLOCTOOLS_HAVE_MMAP
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#endif
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> bs_deb("BACKING");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // The kind of pages used for the memory of pool slabs.
+    // heap        : new char[], no alignment guarantees
+    // pages       : anonymous mmap of normal (4K) pages
+    // transparent : mmap aligned to 2MB with madvise(MADV_HUGEPAGE), the
+    //               kernel backs it with huge pages when it can (THP)
+    // huge_2m     : MAP_HUGETLB with 2MB pages from the hugetlbfs pool
+    // huge_1g     : MAP_HUGETLB with 1GB pages from the hugetlbfs pool
+    // If a policy cannot be satisfied the next smaller one is tried,
+    // huge_1g -> huge_2m -> transparent -> pages.
+    // --------------------------------------------------------------------
+    enum class page_policy
+    {
+        heap,
+        pages,
+        transparent,
+        huge_2m,
+        huge_1g
+    };
+
+    inline const char* to_string(page_policy policy)
+    {
+        switch (policy)
+        {
+        case page_policy::heap: return "heap";
+        case page_policy::pages: return "pages";
+        case page_policy::transparent: return "transparent";
+        case page_policy::huge_2m: return "huge_2m";
+        case page_policy::huge_1g: return "huge_1g";
+        }
+        return "unknown";
+    }
+
+}}    // namespace alloctools::rma
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // Allocates the memory behind a slab according to a page policy and
+    // optionally binds it to a NUMA node (a node index of numa_topology).
+    // A huge page policy is only used for lengths of at least one huge
+    // page, smaller requests fall back to the next policy instead of
+    // wasting most of a huge page.
+    // --------------------------------------------------------------------
+    struct backing_store
+    {
+        static constexpr std::size_t huge_2m_size = std::size_t(1) << 21;
+        static constexpr std::size_t huge_1g_size = std::size_t(1) << 30;
+
+        // ------------------------------------------------------------------
+        // Returns nullptr if policy is heap (and no node is given) or if
+        // nothing could be mapped, the caller then uses the heap.
+        // On success, length is rounded up to a whole number of pages of the
+        // policy that was used, and policy is set to that policy.
+        static void* allocate(std::size_t& length, page_policy& policy, int numa_node)
+        {
+#ifdef ALLOCTOOLS_HAVE_MMAP
+            if (policy == page_policy::heap)
+            {
+                if (numa_node < 0)
+                    return nullptr;
+                policy = page_policy::pages;
+            }
+            void* addr = nullptr;
+            while (addr == nullptr)
+            {
+                std::size_t rounded = length;
+                switch (policy)
+                {
+                case page_policy::huge_1g:
+                    addr = map_huge(rounded, huge_1g_size, 30);
+                    break;
+                case page_policy::huge_2m:
+                    addr = map_huge(rounded, huge_2m_size, 21);
+                    break;
+                case page_policy::transparent:
+                    addr = map_transparent(rounded);
+                    break;
+                default:
+                    addr = map_pages(rounded);
+                    break;
+                }
+                if (addr != nullptr)
+                {
+                    length = rounded;
+                    break;
+                }
+                if (policy == page_policy::pages)
+                {
+                    policy = page_policy::heap;
+                    return nullptr;
+                }
+                GHEX_DP_ONLY(bs_deb,
+                    debug(alloctools::debug::str<>("fallback"), "from",
+                        to_string(policy), alloctools::debug::hex<8>(length)));
+                policy = page_policy(int(policy) - 1);
+            }
+            if (numa_node >= 0)
+            {
+                numa_topology::bind(addr, length, numa_node);
+            }
+            GHEX_DP_ONLY(bs_deb,
+                debug(alloctools::debug::str<>("mapped"), to_string(policy),
+                    alloctools::debug::ptr(addr), alloctools::debug::hex<8>(length),
+                    "node", alloctools::debug::dec<>(numa_node)));
+            return addr;
+#else
+            (void) length;
+            (void) numa_node;
+            policy = page_policy::heap;
+            return nullptr;
+#endif
+        }
+
+        // ------------------------------------------------------------------
+        // length must be the (rounded) length returned by allocate
+        static void release(void* addr, std::size_t length)
+        {
+#ifdef ALLOCTOOLS_HAVE_MMAP
+            ::munmap(addr, length);
+#else
+            (void) addr;
+            (void) length;
+#endif
+        }
+
+    private:
+#ifdef ALLOCTOOLS_HAVE_MMAP
+        static std::size_t round_up(std::size_t length, std::size_t page)
+        {
+            return (length + page - 1) & ~(page - 1);
+        }
+
+        static void* map_pages(std::size_t& length)
+        {
+            length = round_up(length, std::size_t(sysconf(_SC_PAGESIZE)));
+            void* addr = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            return addr == MAP_FAILED ? nullptr : addr;
+        }
+
+        static void* map_huge(std::size_t& length, std::size_t page, int shift)
+        {
+#ifdef MAP_HUGETLB
+            if (length < page)
+                return nullptr;
+            length = round_up(length, page);
+            // huge pages are naturally aligned to their size
+            void* addr = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+                -1, 0);
+            return addr == MAP_FAILED ? nullptr : addr;
+#else
+            (void) length;
+            (void) page;
+            (void) shift;
+            return nullptr;
+#endif
+        }
+
+        // over-allocate by 2MB and unmap the unaligned head and tail so
+        // that the kernel can back the whole range with huge pages
+        static void* map_transparent(std::size_t& length)
+        {
+#ifdef MADV_HUGEPAGE
+            if (length < huge_2m_size)
+                return nullptr;
+            length = round_up(length, huge_2m_size);
+            std::size_t mapped = length + huge_2m_size;
+            void* addr = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (addr == MAP_FAILED)
+                return nullptr;
+            std::uintptr_t base = reinterpret_cast<std::uintptr_t>(addr);
+            std::uintptr_t aligned = round_up(base, huge_2m_size);
+            if (aligned > base)
+            {
+                ::munmap(addr, aligned - base);
+            }
+            std::size_t tail = (base + mapped) - (aligned + length);
+            if (tail > 0)
+            {
+                ::munmap(reinterpret_cast<void*>(aligned + length), tail);
+            }
+            void* result = reinterpret_cast<void*>(aligned);
+            if (::madvise(result, length, MADV_HUGEPAGE) != 0)
+            {
+                GHEX_DP_ONLY(bs_deb,
+                    debug(alloctools::debug::str<>("madvise"), "failed"));
+            }
+            return result;
+#else
+            (void) length;
+            return nullptr;
+#endif
+        }
+#endif
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -0,0 +1,251 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+#include <alloctools/detail/backing_store.hpp>
+#include <alloctools/detail/memory_block_allocator.hpp>
+#include <alloctools/detail/memory_region_impl.hpp>
+#include <alloctools/detail/page_map.hpp>
+#include <alloctools/detail/size_class_table.hpp>
+#include <alloctools/memory_region.hpp>
+//
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <memory>
+#include <new>
+#include <set>
+#include <vector>
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> buddy_deb("BUDDY  ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // A registered arena for allocations larger than the largest size class,
+    // managed as a binary buddy system.
+    //
+    // The arena is a power of two multiple of min_block, a request is given
+    // the smallest power of two number of min_blocks that holds it. Larger
+    // free blocks are split in halves to get there, and a block that is
+    // freed is merged with its buddy (the other half it was split from)
+    // for as long as the buddy is free too.
+    //
+    // One descriptor per min_block is created up front, a block uses the
+    // descriptor of its first min_block (a partial region of the arena with
+    // the arena's keys), so allocating and freeing never touches the
+    // provider. Free blocks are kept in one ordered set per order, so the
+    // lowest free block is always used first. All operations hold a mutex,
+    // the arena is meant for large messages that are rarely allocated.
+    // The whole arena is one arena_span in the page map, the order of the
+    // allocated blocks (kept per min_block) resolves addresses to blocks,
+    // so allocating and freeing do not update the page map.
+    // --------------------------------------------------------------------
+    template <typename RegionProvider>
+    struct buddy_arena
+    {
+        using domain_type = typename RegionProvider::provider_domain;
+        using region_type = memory_region;
+        using region_type_impl = memory_region_impl<RegionProvider>;
+        using allocator_type = memory_block_allocator<RegionProvider>;
+        using block_ptr = typename allocator_type::region_ptr;
+
+        // ------------------------------------------------------------------
+        // min_block must be a power of two, bytes is rounded up to a power
+        // of two multiple of it
+        buddy_arena(domain_type* pd, std::size_t bytes, std::size_t min_block,
+            int numa_node, page_policy policy)
+          : min_shift_(bit_width(min_block) - 1)
+          , max_order_(bit_width((std::max)(bytes, min_block) - 1) - min_shift_)
+          , num_blocks_(std::size_t(1) << max_order_)
+          , page_map_(nullptr)
+          , orders_(new std::atomic<std::uint8_t>[num_blocks_])
+          , free_(max_order_ + 1)
+          , used_bytes_(0)
+        {
+            block_ = allocator_type::malloc(
+                pd, num_blocks_ << min_shift_, numa_node, policy);
+            storage_ = new char[num_blocks_ * sizeof(region_type_impl) + 63];
+            descriptors_ = reinterpret_cast<region_type_impl*>(
+                (reinterpret_cast<std::uintptr_t>(storage_) + 63) &
+                ~std::uintptr_t(63));
+            char* base = static_cast<char*>(block_->get_base_address());
+            for (std::size_t i = 0; i < num_blocks_; ++i)
+            {
+                region_type_impl* r = new (&descriptors_[i]) region_type_impl(
+                    *block_, base + (i << min_shift_), std::size_t(1) << min_shift_,
+                    region_type::BLOCK_PARTIAL | region_type::BLOCK_ARENA);
+                r->set_slab_index(uint32_t(i));
+                r->set_numa_node(uint32_t((std::max)(numa_node, 0)));
+                orders_[i].store(0, std::memory_order_relaxed);
+            }
+            span_.base_ = base;
+            span_.min_shift_ = min_shift_;
+            span_.max_order_ = max_order_;
+            span_.orders_ = orders_.get();
+            span_.descriptors_ = reinterpret_cast<char*>(descriptors_);
+            span_.stride_ = sizeof(region_type_impl);
+            free_[max_order_].insert(0);
+            GHEX_DP_ONLY(buddy_deb,
+                debug(alloctools::debug::str<>("arena"),
+                    alloctools::debug::ptr(base), "bytes",
+                    alloctools::debug::hex<8>(size()), "blocks",
+                    alloctools::debug::dec<>(num_blocks_)));
+        }
+
+        ~buddy_arena()
+        {
+            set_page_map(nullptr);
+            for (std::size_t i = 0; i < num_blocks_; ++i)
+            {
+                descriptors_[i].~region_type_impl();
+            }
+            delete[] storage_;
+        }
+
+        buddy_arena(buddy_arena const&) = delete;
+        buddy_arena& operator=(buddy_arena const&) = delete;
+
+        // ------------------------------------------------------------------
+        // map the arena in a page map (once, blocks are found through it)
+        void set_page_map(page_map* map)
+        {
+            if (page_map_ != nullptr)
+            {
+                page_map_->erase(&span_);
+            }
+            page_map_ = map;
+            if (page_map_ != nullptr)
+            {
+                page_map_->insert(&span_);
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // a region of at least length bytes, nullptr if no free block is
+        // large enough
+        region_type* allocate(std::size_t length)
+        {
+            std::size_t order = order_of(length);
+            if (order > max_order_)
+                return nullptr;
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::size_t k = order;
+            while (k <= max_order_ && free_[k].empty())
+            {
+                ++k;
+            }
+            if (k > max_order_)
+            {
+                GHEX_DP_ONLY(buddy_deb,
+                    debug(alloctools::debug::str<>("exhausted"),
+                        alloctools::debug::hex<8>(length)));
+                return nullptr;
+            }
+            std::size_t index = *free_[k].begin();
+            free_[k].erase(free_[k].begin());
+            // split, keeping the lower half and freeing the upper one
+            while (k > order)
+            {
+                --k;
+                free_[k].insert(index + (std::size_t(1) << k));
+            }
+            region_type_impl* region = &descriptors_[index];
+            region->size_ = std::uint64_t(1) << (order + min_shift_);
+            used_bytes_.fetch_add(region->size_, std::memory_order_relaxed);
+            // publish the block to page map lookups
+            orders_[index].store(
+                std::uint8_t(order + 1), std::memory_order_release);
+            GHEX_DP_ONLY(buddy_deb,
+                trace(alloctools::debug::str<>("allocate"), *region));
+            return region;
+        }
+
+        // ------------------------------------------------------------------
+        void deallocate(region_type* region)
+        {
+            std::size_t index = region->get_slab_index();
+            std::size_t k = order_of(region->get_size());
+            std::lock_guard<std::mutex> lock(mutex_);
+            orders_[index].store(0, std::memory_order_relaxed);
+            used_bytes_.fetch_sub(region->get_size(), std::memory_order_relaxed);
+            // merge with the buddy while it is free
+            while (k < max_order_)
+            {
+                std::size_t buddy = index ^ (std::size_t(1) << k);
+                if (free_[k].erase(buddy) == 0)
+                    break;
+                index = (std::min)(index, buddy);
+                ++k;
+            }
+            free_[k].insert(index);
+            GHEX_DP_ONLY(buddy_deb,
+                trace(alloctools::debug::str<>("free"),
+                    alloctools::debug::dec<>(index), "order",
+                    alloctools::debug::dec<>(k)));
+        }
+
+        // ------------------------------------------------------------------
+        // bytes of the arena, and of the blocks that are in use
+        std::size_t size() const
+        {
+            return num_blocks_ << min_shift_;
+        }
+
+        std::size_t used_bytes() const
+        {
+            return used_bytes_.load(std::memory_order_relaxed);
+        }
+
+        // the largest block that can currently be allocated
+        std::size_t largest_free_block() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::size_t k = max_order_ + 1; k-- > 0;)
+            {
+                if (!free_[k].empty())
+                    return std::size_t(1) << (k + min_shift_);
+            }
+            return 0;
+        }
+
+    private:
+        // the order of the smallest block that holds length bytes
+        inline std::size_t order_of(std::size_t length) const
+        {
+            return bit_width(((std::max)(length, std::size_t(1)) - 1) >> min_shift_);
+        }
+
+        unsigned int min_shift_;
+        std::size_t max_order_;
+        std::size_t num_blocks_;
+        block_ptr block_;
+        char* storage_;
+        region_type_impl* descriptors_;
+        page_map* page_map_;
+        // order+1 of the allocated block starting at each min_block (0 if
+        // none), written under the mutex and read by page map lookups
+        std::unique_ptr<std::atomic<std::uint8_t>[]> orders_;
+        arena_span span_;
+        mutable std::mutex mutex_;
+        // free block indices (in min_blocks) of each order
+        std::vector<std::set<std::size_t>> free_;
+        // updated under the mutex, read without it
+        std::atomic<std::size_t> used_bytes_;
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -0,0 +1,266 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/performance_counter.hpp>
+#include <alloctools/detail/size_class_table.hpp>
+//
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // How the chunks of one size class were used, gathered from the
+    // message lengths (memory_region::set_message_length) of the chunks
+    // returned to the pool. Chunks released without a message length are
+    // only counted in unset_.
+    //
+    // Lengths are kept in num_buckets linear buckets of chunk_size /
+    // num_buckets bytes, so the distribution is known to about 3% of the
+    // chunk size. requested_bytes_ is exact.
+    // --------------------------------------------------------------------
+    struct size_class_usage
+    {
+        static constexpr unsigned int bucket_bits = 5;
+        static constexpr std::size_t num_buckets = std::size_t(1) << bucket_bits;
+
+        std::size_t chunk_size_ = 0;
+        std::uint64_t messages_ = 0;
+        std::uint64_t unset_ = 0;
+        std::uint64_t requested_bytes_ = 0;
+        std::array<std::uint64_t, num_buckets> counts_{};
+
+        // ------------------------------------------------------------------
+        // the largest length that falls into a bucket
+        std::uint64_t bucket_limit(std::size_t b) const
+        {
+            return ((b + 1) * chunk_size_ + num_buckets - 1) >> bucket_bits;
+        }
+
+        // pinned bytes held by the recorded messages, and the part of them
+        // that was not used
+        std::uint64_t chunk_bytes() const
+        {
+            return messages_ * chunk_size_;
+        }
+
+        std::uint64_t waste_bytes() const
+        {
+            return chunk_bytes() - requested_bytes_;
+        }
+
+        double waste_fraction() const
+        {
+            return messages_ == 0 ? 0.0 :
+                                    double(waste_bytes()) / double(chunk_bytes());
+        }
+
+        double mean_length() const
+        {
+            return messages_ == 0 ? 0.0 :
+                                    double(requested_bytes_) / double(messages_);
+        }
+
+        // ------------------------------------------------------------------
+        // the length below which fraction p (0..1) of the messages fall,
+        // reported as the upper limit of its bucket
+        std::uint64_t percentile(double p) const
+        {
+            if (messages_ == 0)
+                return 0;
+            std::uint64_t rank = std::uint64_t(p * double(messages_) + 0.5);
+            rank = (std::max)(rank, std::uint64_t(1));
+            std::uint64_t seen = 0;
+            for (std::size_t b = 0; b < num_buckets; ++b)
+            {
+                seen += counts_[b];
+                if (seen >= rank)
+                    return bucket_limit(b);
+            }
+            return chunk_size_;
+        }
+    };
+
+    // --------------------------------------------------------------------
+    // The predicted effect of serving the recorded messages from a
+    // different table of chunk sizes. Footprint is measured as the chunk
+    // bytes the messages occupy, for the same workload the pinned memory
+    // of the pool scales with it.
+    // --------------------------------------------------------------------
+    struct fragmentation_forecast
+    {
+        std::uint64_t messages_ = 0;
+        std::uint64_t requested_bytes_ = 0;
+        // chunk bytes with the current classes, and with the alternative
+        std::uint64_t current_bytes_ = 0;
+        std::uint64_t predicted_bytes_ = 0;
+        // messages larger than the largest alternative class, they are
+        // counted with their own length (registered on the fly)
+        std::uint64_t oversized_messages_ = 0;
+
+        double current_waste_fraction() const
+        {
+            return current_bytes_ == 0 ?
+                0.0 :
+                1.0 - double(requested_bytes_) / double(current_bytes_);
+        }
+
+        double predicted_waste_fraction() const
+        {
+            return predicted_bytes_ == 0 ?
+                0.0 :
+                1.0 - double(requested_bytes_) / double(predicted_bytes_);
+        }
+
+        // predicted / current footprint, below 1 the alternative is smaller
+        double ratio() const
+        {
+            return current_bytes_ == 0 ?
+                1.0 :
+                double(predicted_bytes_) / double(current_bytes_);
+        }
+    };
+
+    // --------------------------------------------------------------------
+    // what-if: place the messages recorded in usage into the smallest of
+    // chunk_sizes (any sizes, ascending) that holds them. Each message is
+    // taken to be as long as the upper limit of its bucket, so the
+    // predicted waste is slightly pessimistic.
+    // --------------------------------------------------------------------
+    inline fragmentation_forecast forecast_fragmentation(
+        std::vector<size_class_usage> const& usage,
+        std::vector<std::size_t> const& chunk_sizes)
+    {
+        fragmentation_forecast result;
+        for (auto const& u : usage)
+        {
+            result.messages_ += u.messages_;
+            result.requested_bytes_ += u.requested_bytes_;
+            result.current_bytes_ += u.chunk_bytes();
+            for (std::size_t b = 0; b < size_class_usage::num_buckets; ++b)
+            {
+                if (u.counts_[b] == 0)
+                    continue;
+                std::uint64_t length = u.bucket_limit(b);
+                auto it = std::lower_bound(
+                    chunk_sizes.begin(), chunk_sizes.end(), length);
+                if (it == chunk_sizes.end())
+                {
+                    result.oversized_messages_ += u.counts_[b];
+                    result.predicted_bytes_ += u.counts_[b] * length;
+                }
+                else
+                {
+                    result.predicted_bytes_ += u.counts_[b] * (*it);
+                }
+            }
+        }
+        return result;
+    }
+
+}}    // namespace alloctools::rma
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // Records the message lengths of one size class (one add per counter,
+    // no division). Like a latency_histogram the counters are spread over
+    // cache line aligned shards, each thread records into its own shard
+    // with relaxed atomic adds and a snapshot merges the shards.
+    // --------------------------------------------------------------------
+    struct size_class_usage_recorder
+    {
+        size_class_usage_recorder()
+          : chunk_size_(0)
+          , shift_(0)
+        {
+            reset();
+        }
+
+        size_class_usage_recorder(size_class_usage_recorder const&) = delete;
+        size_class_usage_recorder& operator=(
+            size_class_usage_recorder const&) = delete;
+
+        // chunk_size must be a power of two
+        void set_chunk_size(std::size_t chunk_size)
+        {
+            chunk_size_ = chunk_size;
+            shift_ = bit_width(chunk_size) - 1;
+        }
+
+        inline void record(std::uint32_t length)
+        {
+            shard& sh = shards_[debug::counter_shard()];
+            if (length == 0)
+            {
+                sh.unset_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            std::uint64_t l = (std::min)(std::uint64_t(length), chunk_size_);
+            std::size_t b = std::size_t(
+                ((l - 1) << size_class_usage::bucket_bits) >> shift_);
+            sh.counts_[b].fetch_add(1, std::memory_order_relaxed);
+            sh.messages_.fetch_add(1, std::memory_order_relaxed);
+            sh.requested_.fetch_add(l, std::memory_order_relaxed);
+        }
+
+        size_class_usage snapshot() const
+        {
+            size_class_usage s;
+            s.chunk_size_ = std::size_t(chunk_size_);
+            for (auto const& sh : shards_)
+            {
+                for (std::size_t b = 0; b < size_class_usage::num_buckets; ++b)
+                {
+                    s.counts_[b] += sh.counts_[b].load(std::memory_order_relaxed);
+                }
+                s.messages_ += sh.messages_.load(std::memory_order_relaxed);
+                s.unset_ += sh.unset_.load(std::memory_order_relaxed);
+                s.requested_bytes_ += sh.requested_.load(std::memory_order_relaxed);
+            }
+            return s;
+        }
+
+        void reset()
+        {
+            for (auto& sh : shards_)
+            {
+                for (auto& c : sh.counts_)
+                {
+                    c.store(0, std::memory_order_relaxed);
+                }
+                sh.messages_.store(0, std::memory_order_relaxed);
+                sh.unset_.store(0, std::memory_order_relaxed);
+                sh.requested_.store(0, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        struct alignas(64) shard
+        {
+            std::atomic<std::uint64_t> messages_;
+            std::atomic<std::uint64_t> unset_;
+            std::atomic<std::uint64_t> requested_;
+            std::array<std::atomic<std::uint64_t>, size_class_usage::num_buckets>
+                counts_;
+        };
+
+        std::uint64_t chunk_size_;
+        unsigned int shift_;
+        shard shards_[ALLOCTOOLS_COUNTER_SHARDS];
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -0,0 +1,371 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/memory_region.hpp>
+//
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<execinfo.h>) && __has_include(<dlfcn.h>)
+#include <dlfcn.h>
+#include <execinfo.h>
+#define ALLOCTOOLS_HAVE_BACKTRACE
+#endif
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#define ALLOCTOOLS_HAVE_CXXABI
+#endif
+#endif
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // folded : one line per call stack, "outer;...;inner bytes", the input
+    //          of flamegraph.pl and similar tools
+    // pprof  : the (gperftools) heap profile text format read by pprof,
+    //          raw addresses followed by the mapped libraries
+    // --------------------------------------------------------------------
+    enum class heap_profile_format
+    {
+        folded,
+        pprof
+    };
+
+}}    // namespace alloctools::rma
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // A sampling heap profiler for the regions of a memory pool.
+    //
+    // Allocated bytes are sampled at an average rate of one sample every
+    // sample_bytes bytes (the distance to the next sample is drawn from an
+    // exponential distribution, so allocation patterns cannot alias with
+    // the interval). Each thread counts down its own distance, allocations
+    // that are not sampled cost a relaxed load and a subtraction.
+    //
+    // A sampled allocation captures its call stack (backtrace) and is
+    // entered in a table of live samples keyed by stack, the region is
+    // marked so that its release removes it again. A sample of s bytes is
+    // weighted by 1 / (1 - exp(-s / sample_bytes)), the inverse of its
+    // probability of being sampled, so the totals per stack are unbiased
+    // estimates of the memory the stack holds (written by the folded
+    // format). The raw samples are kept as well for the pprof format, pprof
+    // applies the same weights itself. Only sampling and releasing a
+    // sampled region take the mutex.
+    // --------------------------------------------------------------------
+    struct heap_profiler
+    {
+        static constexpr int max_frames = 64;
+        // the frame of sample is dropped, the frames of the pool itself
+        // (unless they were inlined) stay at the top of each stack
+        static constexpr int skip_frames = 1;
+
+        heap_profiler()
+          : sample_bytes_(0)
+          , sample_rate_(0)
+        {
+        }
+
+        heap_profiler(heap_profiler const&) = delete;
+        heap_profiler& operator=(heap_profiler const&) = delete;
+
+        // ------------------------------------------------------------------
+        // start (or restart) sampling, earlier samples are discarded
+        void start(std::size_t sample_bytes)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            live_.clear();
+            stacks_.clear();
+            sample_rate_ = (std::max)(sample_bytes, std::size_t(1));
+            sample_bytes_.store(sample_rate_, std::memory_order_relaxed);
+        }
+
+        // stop taking samples, live samples are kept (and still removed when
+        // their regions are released) so a profile can be written later
+        void stop()
+        {
+            sample_bytes_.store(0, std::memory_order_relaxed);
+        }
+
+        bool running() const
+        {
+            return sample_bytes_.load(std::memory_order_relaxed) != 0;
+        }
+
+        // ------------------------------------------------------------------
+        // called for every region handed out by the pool
+        inline void allocated(memory_region* region)
+        {
+            std::size_t interval = sample_bytes_.load(std::memory_order_relaxed);
+            if (interval == 0)
+                return;
+            thread_state& state = local_state();
+            state.countdown_ -= std::int64_t(region->get_size());
+            if (state.countdown_ > 0)
+                return;
+            state.countdown_ = next_distance(state, interval);
+            sample(region, interval);
+        }
+
+        // called for every region returned to the pool
+        inline void released(memory_region* region)
+        {
+            if (region->get_sampled_region())
+            {
+                remove(region);
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // write the live samples (memory held now, by call stack)
+        void write(std::ostream& os, heap_profile_format format) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (format == heap_profile_format::folded)
+            {
+                write_folded(os);
+            }
+            else
+            {
+                write_pprof(os);
+            }
+        }
+
+    private:
+        // ------------------------------------------------------------------
+        struct stack_entry
+        {
+            // estimated number of regions and bytes held, and allocated
+            // since sampling started
+            double live_count_ = 0;
+            double live_bytes_ = 0;
+            double total_count_ = 0;
+            double total_bytes_ = 0;
+            // the samples themselves, live and since sampling started
+            std::uint64_t live_samples_ = 0;
+            std::uint64_t live_sample_bytes_ = 0;
+            std::uint64_t total_samples_ = 0;
+            std::uint64_t total_sample_bytes_ = 0;
+        };
+
+        using stack_map = std::map<std::vector<void*>, stack_entry>;
+
+        struct live_sample
+        {
+            stack_map::iterator stack_;
+            double count_;
+            double bytes_;
+            std::uint64_t size_;
+        };
+
+        struct thread_state
+        {
+            thread_state()
+              : countdown_(0)
+              , started_(false)
+              , rng_(std::uint32_t(
+                    std::hash<std::thread::id>()(std::this_thread::get_id())))
+            {
+            }
+
+            std::int64_t countdown_;
+            bool started_;
+            std::minstd_rand rng_;
+        };
+
+        // the countdown is per thread and shared by all pools, with the
+        // exponential distribution this does not bias any of them
+        static thread_state& local_state()
+        {
+            static thread_local thread_state state;
+            return state;
+        }
+
+        static std::int64_t next_distance(thread_state& state, std::size_t interval)
+        {
+            std::exponential_distribution<double> distance(1.0 / double(interval));
+            return std::int64_t(distance(state.rng_)) + 1;
+        }
+
+        // ------------------------------------------------------------------
+        void sample(memory_region* region, std::size_t interval)
+        {
+            thread_state& state = local_state();
+            if (!state.started_)
+            {
+                // the first allocation of a thread only draws its distance
+                state.started_ = true;
+                return;
+            }
+            std::vector<void*> frames;
+#ifdef ALLOCTOOLS_HAVE_BACKTRACE
+            void* buffer[max_frames + skip_frames];
+            int n = ::backtrace(buffer, max_frames + skip_frames);
+            if (n > skip_frames)
+            {
+                frames.assign(buffer + skip_frames, buffer + n);
+            }
+#endif
+            double size = double(region->get_size());
+            double p = 1.0 - std::exp(-size / double(interval));
+            double count = (p > 0) ? 1.0 / p : 1.0;
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = stacks_.emplace(std::move(frames), stack_entry()).first;
+            it->second.live_count_ += count;
+            it->second.live_bytes_ += count * size;
+            it->second.total_count_ += count;
+            it->second.total_bytes_ += count * size;
+            ++it->second.live_samples_;
+            it->second.live_sample_bytes_ += region->get_size();
+            ++it->second.total_samples_;
+            it->second.total_sample_bytes_ += region->get_size();
+            live_[region] = live_sample{it, count, count * size, region->get_size()};
+            region->set_sampled_region(true);
+        }
+
+        void remove(memory_region* region)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            region->set_sampled_region(false);
+            auto it = live_.find(region);
+            if (it == live_.end())
+                return;
+            it->second.stack_->second.live_count_ -= it->second.count_;
+            it->second.stack_->second.live_bytes_ -= it->second.bytes_;
+            --it->second.stack_->second.live_samples_;
+            it->second.stack_->second.live_sample_bytes_ -= it->second.size_;
+            live_.erase(it);
+        }
+
+        // ------------------------------------------------------------------
+        // the name of the function containing a return address
+        static std::string symbol(void* address)
+        {
+            char buffer[32];
+#ifdef ALLOCTOOLS_HAVE_BACKTRACE
+            // look up the call instruction, not the one after it
+            void* pc = static_cast<char*>(address) - 1;
+            Dl_info info;
+            if (::dladdr(pc, &info) != 0)
+            {
+                if (info.dli_sname != nullptr)
+                {
+                    std::string name = info.dli_sname;
+#ifdef ALLOCTOOLS_HAVE_CXXABI
+                    int status = 0;
+                    char* demangled =
+                        abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+                    if (status == 0 && demangled != nullptr)
+                    {
+                        name = demangled;
+                    }
+                    std::free(demangled);
+#endif
+                    return name;
+                }
+                if (info.dli_fname != nullptr)
+                {
+                    std::snprintf(buffer, sizeof(buffer), "+0x%lx",
+                        static_cast<unsigned long>(static_cast<char*>(pc) -
+                            static_cast<char*>(info.dli_fbase)));
+                    return std::string(info.dli_fname) + buffer;
+                }
+            }
+#endif
+            std::snprintf(buffer, sizeof(buffer), "%p", address);
+            return buffer;
+        }
+
+        void write_folded(std::ostream& os) const
+        {
+            for (auto const& s : stacks_)
+            {
+                std::uint64_t bytes = std::uint64_t(s.second.live_bytes_ + 0.5);
+                if (bytes == 0)
+                    continue;
+                if (s.first.empty())
+                {
+                    os << "[unknown]";
+                }
+                // outermost frame first
+                for (std::size_t i = s.first.size(); i-- > 0;)
+                {
+                    os << symbol(s.first[i]) << (i == 0 ? "" : ";");
+                }
+                os << " " << bytes << "\n";
+            }
+        }
+
+        // the raw samples, pprof weights them by the rate in the header
+        void write_pprof(std::ostream& os) const
+        {
+            stack_entry total;
+            for (auto const& s : stacks_)
+            {
+                total.live_samples_ += s.second.live_samples_;
+                total.live_sample_bytes_ += s.second.live_sample_bytes_;
+                total.total_samples_ += s.second.total_samples_;
+                total.total_sample_bytes_ += s.second.total_sample_bytes_;
+            }
+            auto counts = [&os](stack_entry const& e) {
+                os << e.live_samples_ << ": " << e.live_sample_bytes_ << " ["
+                   << e.total_samples_ << ": " << e.total_sample_bytes_ << "]";
+            };
+            os << "heap profile: ";
+            counts(total);
+            os << " @ heap_v2/" << sample_rate_ << "\n";
+            for (auto const& s : stacks_)
+            {
+                counts(s.second);
+                os << " @";
+                for (void* frame : s.first)
+                {
+                    os << " " << frame;
+                }
+                os << "\n";
+            }
+            // pprof needs the mappings to symbolize the addresses
+            os << "\nMAPPED_LIBRARIES:\n";
+            std::ifstream maps("/proc/self/maps");
+            if (maps)
+            {
+                os << maps.rdbuf();
+            }
+        }
+
+        std::atomic<std::size_t> sample_bytes_;
+        // the rate of the samples taken, kept when sampling stops
+        std::size_t sample_rate_;
+        mutable std::mutex mutex_;
+        stack_map stacks_;
+        std::unordered_map<memory_region const*, live_sample> live_;
+    };
+
+}}}    // namespace alloctools::rma::detail
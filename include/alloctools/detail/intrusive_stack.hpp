@@ -0,0 +1,199 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/config_defines.hpp>
+#include <alloctools/memory_region.hpp>
+//
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // A lock-free (Treiber) stack of memory regions that links the regions
+    // through their own next_ field, so push and pop never allocate.
+    //
+    // The head is a single 64 bit word holding the region pointer in the
+    // low 48 bits and a 16 bit tag in the high bits that is incremented on
+    // every change of the head, which makes the CAS immune to ABA unless a
+    // thread is preempted for 65536 head updates at the exact point between
+    // reading the head and its CAS. This relies on user space pointers
+    // fitting into 48 bits (true with 4 level page tables).
+    //
+    // A pop reads next_ of a region that another thread may have popped in
+    // the meantime, regions must therefore stay allocated for as long as
+    // the stack is in use (even after they have been removed from it).
+    // --------------------------------------------------------------------
+    struct intrusive_stack
+    {
+        intrusive_stack()
+          : head_(0)
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+          , retries_(0)
+#endif
+        {
+        }
+
+        intrusive_stack(intrusive_stack const&) = delete;
+        intrusive_stack& operator=(intrusive_stack const&) = delete;
+
+        // ------------------------------------------------------------------
+        inline void push(memory_region* region)
+        {
+            push_chain(region, region);
+        }
+
+        // ------------------------------------------------------------------
+        // push a range of regions with a single CAS
+        void push(memory_region** begin, memory_region** end)
+        {
+            if (begin == end)
+                return;
+            for (memory_region** r = begin; r + 1 != end; ++r)
+            {
+                (*r)->next_.store(*(r + 1), std::memory_order_relaxed);
+            }
+            push_chain(*begin, *(end - 1));
+        }
+
+        // ------------------------------------------------------------------
+        // push regions that are already linked first->...->last
+        inline void push_chain(memory_region* first, memory_region* last)
+        {
+            std::uint64_t head = head_.load(std::memory_order_relaxed);
+            last->next_.store(pointer(head), std::memory_order_relaxed);
+            while (!head_.compare_exchange_weak(head, pack(first, tag(head) + 1),
+                std::memory_order_release, std::memory_order_relaxed))
+            {
+                retried();
+                last->next_.store(pointer(head), std::memory_order_relaxed);
+            }
+        }
+
+        // ------------------------------------------------------------------
+        inline bool pop(memory_region*& region)
+        {
+            std::uint64_t head = head_.load(std::memory_order_acquire);
+            while (true)
+            {
+                memory_region* top = pointer(head);
+                if (top == nullptr)
+                    return false;
+                memory_region* next = top->next_.load(std::memory_order_relaxed);
+                if (head_.compare_exchange_weak(head, pack(next, tag(head) + 1),
+                        std::memory_order_acquire, std::memory_order_acquire))
+                {
+                    region = top;
+                    return true;
+                }
+                retried();
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // pop up to n regions with a single CAS, returns the number popped.
+        // The chain is walked before the CAS, if the head changed meanwhile
+        // the tag makes the CAS fail and the walk is repeated
+        std::size_t pop(memory_region** out, std::size_t n)
+        {
+            if (n == 0)
+                return 0;
+            std::uint64_t head = head_.load(std::memory_order_acquire);
+            while (true)
+            {
+                memory_region* top = pointer(head);
+                if (top == nullptr)
+                    return 0;
+                memory_region* last = top;
+                std::size_t count = 1;
+                while (count < n)
+                {
+                    memory_region* next = last->next_.load(std::memory_order_relaxed);
+                    if (next == nullptr)
+                        break;
+                    last = next;
+                    ++count;
+                }
+                memory_region* rest = last->next_.load(std::memory_order_relaxed);
+                if (head_.compare_exchange_weak(head, pack(rest, tag(head) + 1),
+                        std::memory_order_acquire, std::memory_order_acquire))
+                {
+                    // the chain is ours now
+                    for (std::size_t i = 0; i < count; ++i)
+                    {
+                        out[i] = top;
+                        top = top->next_.load(std::memory_order_relaxed);
+                    }
+                    return count;
+                }
+                retried();
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // only a hint when other threads are pushing/popping
+        inline bool empty() const
+        {
+            return pointer(head_.load(std::memory_order_relaxed)) == nullptr;
+        }
+
+        // ------------------------------------------------------------------
+        // the number of failed CAS operations on the head (always 0 unless
+        // ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS is defined)
+        std::uint64_t cas_retries() const
+        {
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            return retries_.load(std::memory_order_relaxed);
+#else
+            return 0;
+#endif
+        }
+
+    private:
+        static constexpr unsigned int tag_shift = 48;
+
+        inline void retried()
+        {
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            retries_.fetch_add(1, std::memory_order_relaxed);
+#endif
+        }
+        static constexpr std::uint64_t pointer_mask =
+            (std::uint64_t(1) << tag_shift) - 1;
+
+        static inline memory_region* pointer(std::uint64_t head)
+        {
+            return reinterpret_cast<memory_region*>(head & pointer_mask);
+        }
+
+        static inline std::uint64_t tag(std::uint64_t head)
+        {
+            return head >> tag_shift;
+        }
+
+        static inline std::uint64_t pack(memory_region* region, std::uint64_t tag)
+        {
+            std::uint64_t p = reinterpret_cast<std::uint64_t>(region);
+            assert((p & ~pointer_mask) == 0);
+            return p | (tag << tag_shift);
+        }
+
+        alignas(64) std::atomic<std::uint64_t> head_;
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+        // on its own line, it is only written when the head is contended
+        alignas(64) std::atomic<std::uint64_t> retries_;
+#endif
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -0,0 +1,272 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/performance_counter.hpp>
+#include <alloctools/detail/size_class_table.hpp>
+//
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // the memory pool operations that latencies are recorded for when
+    // ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS is defined
+    // allocate     : allocate_region
+    // deallocate   : deallocate
+    // grow         : a stack allocating and registering a new slab
+    // registration : allocate_temporary_region, register_temporary_region
+    // --------------------------------------------------------------------
+    enum class pool_operation
+    {
+        allocate,
+        deallocate,
+        grow,
+        registration
+    };
+
+    // --------------------------------------------------------------------
+    // A copy of the counts of a latency histogram, snapshots of different
+    // histograms (threads, size classes, pools) can be merged.
+    // Values are in nanoseconds (or any other unit that was recorded).
+    //
+    // Buckets are log-linear: values below 8 have a bucket each, above that
+    // every power of two is split into 8 buckets, so a percentile is
+    // reported with a relative error of at most 12.5%.
+    // --------------------------------------------------------------------
+    struct latency_snapshot
+    {
+        static constexpr unsigned int sub_bits = 3;
+        static constexpr std::size_t sub_buckets = std::size_t(1) << sub_bits;
+        // enough for values up to 2^40 ns (about 18 minutes)
+        static constexpr std::size_t num_buckets = (40 - sub_bits + 1) * sub_buckets;
+
+        std::array<std::uint64_t, num_buckets> counts_{};
+        std::uint64_t count_ = 0;
+        std::uint64_t sum_ = 0;
+        std::uint64_t min_ = (std::numeric_limits<std::uint64_t>::max)();
+        std::uint64_t max_ = 0;
+
+        // ------------------------------------------------------------------
+        static inline std::size_t bucket(std::uint64_t value)
+        {
+            unsigned int width = detail::bit_width(value);
+            if (width <= sub_bits)
+                return std::size_t(value);
+            unsigned int shift = width - sub_bits - 1;
+            std::size_t b = (std::size_t(shift) + 1) * sub_buckets +
+                std::size_t((value >> shift) & (sub_buckets - 1));
+            return (std::min)(b, num_buckets - 1);
+        }
+
+        // the largest value that falls into a bucket
+        static inline std::uint64_t bucket_limit(std::size_t b)
+        {
+            if (b < sub_buckets)
+                return b;
+            unsigned int shift = unsigned(b / sub_buckets) - 1;
+            std::uint64_t low = (sub_buckets + (b % sub_buckets)) << shift;
+            return low + (std::uint64_t(1) << shift) - 1;
+        }
+
+        // ------------------------------------------------------------------
+        void merge(latency_snapshot const& other)
+        {
+            for (std::size_t b = 0; b < num_buckets; ++b)
+            {
+                counts_[b] += other.counts_[b];
+            }
+            count_ += other.count_;
+            sum_ += other.sum_;
+            min_ = (std::min)(min_, other.min_);
+            max_ = (std::max)(max_, other.max_);
+        }
+
+        // ------------------------------------------------------------------
+        std::uint64_t count() const
+        {
+            return count_;
+        }
+
+        std::uint64_t min() const
+        {
+            return count_ == 0 ? 0 : min_;
+        }
+
+        std::uint64_t max() const
+        {
+            return max_;
+        }
+
+        double mean() const
+        {
+            return count_ == 0 ? 0.0 : double(sum_) / double(count_);
+        }
+
+        // ------------------------------------------------------------------
+        // the value below which fraction p (0..1) of the recorded values
+        // fall, reported as the upper limit of its bucket (and at most max)
+        std::uint64_t percentile(double p) const
+        {
+            if (count_ == 0)
+                return 0;
+            std::uint64_t rank = std::uint64_t(p * double(count_) + 0.5);
+            rank = (std::max)(rank, std::uint64_t(1));
+            std::uint64_t seen = 0;
+            for (std::size_t b = 0; b < num_buckets; ++b)
+            {
+                seen += counts_[b];
+                if (seen >= rank)
+                    return (std::min)(bucket_limit(b), max_);
+            }
+            return max_;
+        }
+    };
+
+}}    // namespace alloctools::rma
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // A histogram that many threads record into. The counts are spread over
+    // cache line aligned shards like a debug::sharded_counter, each thread
+    // records into its own shard with relaxed atomics (so threads do not
+    // contend unless there are more threads than shards). A snapshot merges
+    // the shards (without stopping writers).
+    // --------------------------------------------------------------------
+    struct latency_histogram
+    {
+        static_assert((ALLOCTOOLS_COUNTER_SHARDS & (ALLOCTOOLS_COUNTER_SHARDS - 1)) == 0,
+            "ALLOCTOOLS_COUNTER_SHARDS must be a power of two");
+
+        latency_histogram()
+        {
+            reset();
+        }
+
+        latency_histogram(latency_histogram const&) = delete;
+        latency_histogram& operator=(latency_histogram const&) = delete;
+
+        inline void record(std::uint64_t value)
+        {
+            shards_[debug::counter_shard()].record(value);
+        }
+
+        latency_snapshot snapshot() const
+        {
+            latency_snapshot s;
+            for (auto const& sh : shards_)
+            {
+                s.merge(sh.snapshot());
+            }
+            return s;
+        }
+
+        void reset()
+        {
+            for (auto& sh : shards_)
+            {
+                sh.reset();
+            }
+        }
+
+    private:
+        struct alignas(64) shard
+        {
+            inline void record(std::uint64_t value)
+            {
+                counts_[latency_snapshot::bucket(value)].fetch_add(
+                    1, std::memory_order_relaxed);
+                count_.fetch_add(1, std::memory_order_relaxed);
+                sum_.fetch_add(value, std::memory_order_relaxed);
+                // min/max are rarely changed, so they are read before writing
+                std::uint64_t m = min_.load(std::memory_order_relaxed);
+                while (value < m &&
+                    !min_.compare_exchange_weak(m, value, std::memory_order_relaxed))
+                {
+                }
+                m = max_.load(std::memory_order_relaxed);
+                while (value > m &&
+                    !max_.compare_exchange_weak(m, value, std::memory_order_relaxed))
+                {
+                }
+            }
+
+            latency_snapshot snapshot() const
+            {
+                latency_snapshot s;
+                for (std::size_t b = 0; b < latency_snapshot::num_buckets; ++b)
+                {
+                    s.counts_[b] = counts_[b].load(std::memory_order_relaxed);
+                }
+                s.count_ = count_.load(std::memory_order_relaxed);
+                s.sum_ = sum_.load(std::memory_order_relaxed);
+                s.min_ = min_.load(std::memory_order_relaxed);
+                s.max_ = max_.load(std::memory_order_relaxed);
+                return s;
+            }
+
+            void reset()
+            {
+                for (auto& c : counts_)
+                {
+                    c.store(0, std::memory_order_relaxed);
+                }
+                count_.store(0, std::memory_order_relaxed);
+                sum_.store(0, std::memory_order_relaxed);
+                min_.store((std::numeric_limits<std::uint64_t>::max)(),
+                    std::memory_order_relaxed);
+                max_.store(0, std::memory_order_relaxed);
+            }
+
+            // the totals first, they are updated by every record
+            std::atomic<std::uint64_t> count_;
+            std::atomic<std::uint64_t> sum_;
+            std::atomic<std::uint64_t> min_;
+            std::atomic<std::uint64_t> max_;
+            std::array<std::atomic<std::uint64_t>, latency_snapshot::num_buckets>
+                counts_;
+        };
+        shard shards_[ALLOCTOOLS_COUNTER_SHARDS];
+    };
+
+    // --------------------------------------------------------------------
+    // records the time from construction to destruction into a histogram
+    // --------------------------------------------------------------------
+    struct latency_timer
+    {
+        explicit latency_timer(latency_histogram& histogram)
+          : histogram_(histogram)
+          , start_(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~latency_timer()
+        {
+            histogram_.record(std::uint64_t(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start_)
+                    .count()));
+        }
+
+    private:
+        latency_histogram& histogram_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+}}}    // namespace alloctools::rma::detail
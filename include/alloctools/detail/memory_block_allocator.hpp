@@ -12,8 +12,6 @@
 
 #include <alloctools/detail/memory_region_impl.hpp>
 //
-#include <boost/lockfree/stack.hpp>
-//
 #include <array>
 #include <atomic>
 #include <cstddef>
@@ -52,11 +50,14 @@ namespace alloctools { namespace rma { namespace detail {
         // default empty constructor
         memory_block_allocator() {}
 
-        // allocate a registered memory region
-        static region_ptr malloc(domain_type* pd, const std::size_t bytes)
+        // allocate a registered memory region, optionally bound to a NUMA node
+        // and backed by huge pages (the region may be larger than requested
+        // when the length is rounded up to whole pages, see get_size)
+        static region_ptr malloc(domain_type* pd, const std::size_t bytes,
+            int numa_node = -1, page_policy policy = page_policy::heap)
         {
             region_ptr region = std::make_shared<region_type>();
-            region->allocate(pd, bytes);
+            region->allocate(pd, bytes, numa_node, policy);
             GHEX_DP_ONLY(mbs_deb,
                 trace(alloctools::debug::str<>("Allocating"),
                     alloctools::debug::hex<4>(bytes), "chunk mallocator", *region));
@@ -0,0 +1,178 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+//
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> refill_deb("REFILL ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // The refill worker owns a background thread that grows memory pool
+    // stacks when their free count drops below the low watermark, so that
+    // the (expensive) allocation and registration of new blocks does not
+    // happen on the thread that is trying to pop a region.
+    // Stacks request a refill via request_refill, the worker then calls
+    // stack->refill() on its own thread. A stack must not request a new
+    // refill until the previous one has been started (see refill_pending_)
+    //
+    // The worker can also periodically release slabs that have been
+    // completely unused for longer than an idle timeout, see set_idle_release
+    // --------------------------------------------------------------------
+    template <typename Stack>
+    struct memory_pool_refill_worker
+    {
+        memory_pool_refill_worker()
+          : stop_(false)
+          , reconfigure_(false)
+          , idle_timeout_(0)
+        {
+            thread_ = std::thread([this]() { run(); });
+        }
+
+        ~memory_pool_refill_worker()
+        {
+            stop();
+        }
+
+        // ------------------------------------------------------------------
+        // queue a stack for refilling and wake the worker
+        void request_refill(Stack* stack)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.push_back(stack);
+            }
+            cond_.notify_one();
+        }
+
+        // ------------------------------------------------------------------
+        // release slabs of these stacks that have been idle for longer than
+        // timeout, the stacks are checked every timeout/2
+        void set_idle_release(
+            std::vector<Stack*> const& stacks, std::chrono::milliseconds timeout)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                idle_stacks_ = stacks;
+                idle_timeout_ = timeout;
+                reconfigure_ = true;
+            }
+            cond_.notify_one();
+        }
+
+        // ------------------------------------------------------------------
+        // finish any pending refills and join the worker thread,
+        // must be called before the stacks are deallocated
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_)
+                    return;
+                stop_ = true;
+            }
+            cond_.notify_one();
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+        }
+
+    private:
+        // called with the lock held, which is dropped while releasing slabs
+        void release_idle(std::unique_lock<std::mutex>& lock)
+        {
+            using namespace std::chrono;
+            std::vector<Stack*> stacks = idle_stacks_;
+            std::int64_t idle_before =
+                duration_cast<nanoseconds>(
+                    (steady_clock::now() - idle_timeout_).time_since_epoch())
+                    .count();
+            lock.unlock();
+            for (Stack* stack : stacks)
+            {
+                std::size_t bytes = stack->release_slabs(
+                    (std::numeric_limits<std::size_t>::max)(), idle_before);
+                GHEX_DP_ONLY(refill_deb,
+                    debug(alloctools::debug::str<>(stack->desc()),
+                        "idle release", alloctools::debug::hex<8>(bytes)));
+                (void) bytes;
+            }
+            lock.lock();
+        }
+
+        void run()
+        {
+            using namespace std::chrono;
+            std::vector<Stack*> work;
+            std::unique_lock<std::mutex> lock(mutex_);
+            steady_clock::time_point next_sweep = steady_clock::now();
+            while (true)
+            {
+                auto ready = [this]() {
+                    return stop_ || reconfigure_ || !pending_.empty();
+                };
+                if (idle_timeout_.count() > 0)
+                {
+                    cond_.wait_until(lock, next_sweep, ready);
+                }
+                else
+                {
+                    cond_.wait(lock, ready);
+                }
+                if (stop_)
+                    break;
+                reconfigure_ = false;
+                if (idle_timeout_.count() > 0 &&
+                    steady_clock::now() >= next_sweep)
+                {
+                    next_sweep = steady_clock::now() + idle_timeout_ / 2;
+                    release_idle(lock);
+                }
+                work.swap(pending_);
+                lock.unlock();
+                for (Stack* stack : work)
+                {
+                    GHEX_DP_ONLY(refill_deb,
+                        debug(alloctools::debug::str<>(stack->desc()),
+                            "background refill"));
+                    stack->refill();
+                }
+                work.clear();
+                lock.lock();
+            }
+        }
+
+        bool stop_;
+        bool reconfigure_;
+        std::chrono::milliseconds idle_timeout_;
+        std::vector<Stack*> idle_stacks_;
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::vector<Stack*> pending_;
+        std::thread thread_;
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -10,25 +10,39 @@
  */
 #pragma once
 
+#include <alloctools/config_defines.hpp>
+#include <alloctools/detail/intrusive_stack.hpp>
+#include <alloctools/detail/latency_histogram.hpp>
+#include <alloctools/detail/memory_pool_refill.hpp>
 #include <alloctools/detail/memory_region_impl.hpp>
+#include <alloctools/detail/page_map.hpp>
+#include <alloctools/detail/region_tracker.hpp>
+#include <alloctools/detail/slab_directory.hpp>
 #include <alloctools/debugging/performance_counter.hpp>
+#include <alloctools/pool_statistics.hpp>
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+#include <alloctools/detail/region_magazine.hpp>
+#endif
 //
-#include <boost/lockfree/stack.hpp>
-//
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stack>
 #include <string>
-#include <unordered_map>
+#include <thread>
+#include <vector>
 
-// Define this to track which regions were not returned to the pool after use
-#ifdef RMA_POOL_DEBUG_SET
-#include <mutex>
-#include <set>
+// The number of regions each thread may cache per stack when the
+// thread local magazine layer is enabled
+#if defined(ALLOCTOOLS_HAVE_THREAD_CACHE) && !defined(ALLOCTOOLS_THREAD_CACHE_SIZE)
+#define ALLOCTOOLS_THREAD_CACHE_SIZE 32
 #endif
 
 namespace alloctools {
@@ -39,38 +53,6 @@ namespace alloctools {
 
 namespace alloctools { namespace rma { namespace detail {
 
-    namespace bl = boost::lockfree;
-
-    // A simple tag type we use for logging assistance (identification)
-    struct pool_tiny
-    {
-        static const char* desc()
-        {
-            return "Tiny ";
-        }
-    };
-    struct pool_small
-    {
-        static const char* desc()
-        {
-            return "Small ";
-        }
-    };
-    struct pool_medium
-    {
-        static const char* desc()
-        {
-            return "Medium ";
-        }
-    };
-    struct pool_large
-    {
-        static const char* desc()
-        {
-            return "Large ";
-        }
-    };
-
     // ---------------------------------------------------------------------------
     // memory pool stack is responsible for allocating large blocks of memory
     // from the system heap and splitting them into N small equally sized region/blocks
@@ -78,114 +60,525 @@ namespace alloctools { namespace rma { namespace detail {
     // appropriate size is required.
     //
     // The memory pool class maintains N of these stacks for different sized blocks
+    //
+    // When ALLOCTOOLS_HAVE_THREAD_CACHE is defined, each thread keeps a small
+    // magazine of regions per stack, pop/push only touch the shared free list
+    // when the magazine must be refilled or flushed (in batches)
+    //
+    // Each stack has a low and high watermark. When a refill worker is attached
+    // and the number of free chunks drops below the low watermark, the worker
+    // grows the stack back up to the high watermark on its own thread. Without
+    // a worker the stack grows synchronously when it runs dry.
+    //
+    // Growth is safe from any thread: slabs are recorded in a directory with
+    // lock-free lookup, and when the stack runs dry exactly one thread is
+    // elected to grow it while the others spin on the free list.
+    //
+    // Each slab counts how many of its chunks are on the shared free list,
+    // a slab whose chunks are all free can be released (deregistered and
+    // returned to the system) by release_slabs. A released slab leaves the
+    // slab directory (its slot is reused) but the slab and its region
+    // descriptors are not freed, because the free list is intrusive (see
+    // intrusive_stack) and directory readers may still hold it. They are
+    // kept on a retired list and reused, rebound in place, by a later slab
+    // that fits in them. The same election flag used for growth ensures only
+    // one thread grows or trims the stack at a time. While a trim has taken
+    // the chunks off the free list, pops that find the stack empty wait for
+    // it to put back the chunks it keeps, rather than growing the stack or
+    // requesting a refill.
+    //
+    // A stack created for a NUMA node (numa_node >= 0, a node index of
+    // numa_topology) binds the memory of all its slabs to that node. Slabs
+    // may be backed by huge pages (see page_policy), when the slab length is
+    // rounded up to whole pages the extra memory is carved into additional
+    // chunks.
     // ---------------------------------------------------------------------------
-    template <typename RegionProvider, typename Allocator, typename PoolType,
-        std::size_t ChunkSize>
+    template <typename RegionProvider, typename Allocator>
     struct memory_pool_stack
     {
         using domain_type      = typename RegionProvider::provider_domain;
         using region_type      = memory_region;
         using region_type_impl = detail::memory_region_impl<RegionProvider>;
         using region_ptr       = std::shared_ptr<region_type_impl>;
+        using refill_worker_type = memory_pool_refill_worker<memory_pool_stack>;
+
+        // ------------------------------------------------------------------------
+        // a slab is one large registered block and the regions carved from it,
+        // the region descriptors of a slab are stored in one contiguous array
+        // of cache line sized records (so descriptor memory is a fixed
+        // 64 bytes per chunk).
+        // A reused slab may have more descriptors (capacity_) than chunks
+        struct slab
+        {
+            slab(std::size_t num_chunks)
+              : capacity_(num_chunks)
+              , num_chunks_(num_chunks)
+              , storage_(nullptr)
+              , descriptors_(nullptr)
+              , span_()
+              , trim_count_(0)
+              , free_chunks_(0)
+              , idle_since_(0)
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+              , track_(new region_track_record[num_chunks])
+#endif
+            {
+            }
+
+            ~slab()
+            {
+                if (descriptors_ != nullptr)
+                {
+                    for (std::size_t i = 0; i < capacity_; ++i)
+                    {
+                        descriptors_[i].~region_type_impl();
+                    }
+                }
+                delete[] storage_;
+            }
+
+            // construct a partial region for every chunk of block_
+            void create_descriptors(std::size_t chunk_size)
+            {
+                storage_ = new char[capacity_ * sizeof(region_type_impl) + 63];
+                descriptors_ = reinterpret_cast<region_type_impl*>(
+                    (reinterpret_cast<std::uintptr_t>(storage_) + 63) &
+                    ~std::uintptr_t(63));
+                char* base = static_cast<char*>(block_->get_base_address());
+                for (std::size_t i = 0; i < capacity_; ++i)
+                {
+                    new (&descriptors_[i]) region_type_impl(*block_,
+                        base + i * chunk_size, chunk_size,
+                        region_type::BLOCK_PARTIAL);
+                }
+            }
+
+            // reuse the descriptors of a retired slab for the chunks of a
+            // new block_ (num_chunks <= capacity_)
+            void rebind_descriptors(std::size_t num_chunks, std::size_t chunk_size)
+            {
+                num_chunks_ = num_chunks;
+                trim_count_ = 0;
+                char* base = static_cast<char*>(block_->get_base_address());
+                for (std::size_t i = 0; i < num_chunks_; ++i)
+                {
+                    descriptors_[i].rebind(*block_, base + i * chunk_size,
+                        chunk_size, region_type::BLOCK_PARTIAL);
+                }
+            }
+
+            inline region_type* region(std::size_t i) const
+            {
+                return &descriptors_[i];
+            }
+
+            static_assert(sizeof(region_type_impl) <= 64,
+                "memory pool region descriptors should fit in a cache line");
+
+            const std::size_t capacity_;
+            std::size_t num_chunks_;
+            region_ptr block_;
+            char* storage_;
+            region_type_impl* descriptors_;
+            // address lookup of the chunks, see page_map
+            slab_span span_;
+            // only used while the stack is being trimmed (under growing_)
+            std::size_t trim_count_;
+            // number of chunks of this slab on the shared free list,
+            // on its own cache line as it is updated by every push/pop
+            alignas(64) std::atomic<std::size_t> free_chunks_;
+            // time (steady clock ns) at which the last chunk was returned
+            std::atomic<std::int64_t> idle_since_;
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            // allocation state of each chunk, see region_tracker
+            std::unique_ptr<region_track_record[]> track_;
+#endif
+        };
 
         // ------------------------------------------------------------------------
-        memory_pool_stack(domain_type* pd, int num_initial_chunks)
+        static std::int64_t now_ns()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        }
+
+        // ------------------------------------------------------------------------
+        memory_pool_stack(domain_type* pd, uint32_t size_class,
+            std::size_t chunk_size, std::size_t num_initial_chunks,
+            int numa_node = -1, page_policy policy = page_policy::heap)
           : accesses_(0)
           , in_use_(0)
           , chunks_avail_(0)
+          , free_count_(0)
+          , slow_path_count_(0)
+          , grow_count_(0)
+          , slab_release_count_(0)
+          , low_watermark_(num_initial_chunks / 4)
+          , high_watermark_((std::max)(num_initial_chunks, std::size_t(1)))
+          , refill_pending_(false)
+          , growing_(false)
+          , trim_epoch_(0)
+          , refill_worker_(nullptr)
+          , page_map_(nullptr)
           , pd_(pd)
-          , free_list_(num_initial_chunks)
+          , size_class_(size_class)
+          , chunk_size_(chunk_size)
+          , numa_node_(numa_node)
+          , page_policy_(policy)
         {
+            std::stringstream temp;
+            if (numa_node_ >= 0)
+            {
+                temp << "Node " << alloctools::debug::dec<2>(numa_node_) << " ";
+            }
+            temp << "Class " << alloctools::debug::dec<2>(size_class_) << " ";
+            desc_ = temp.str();
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            magazine_id_ = magazine_registry::next_id();
+            magazine_slot_ = magazine_registry::instance().add(
+                magazine_id_, this, &memory_pool_stack::flush_regions);
+#endif
             allocate_pool(num_initial_chunks);
         }
 
         // ------------------------------------------------------------------------
-        bool allocate_pool(uint32_t num_chunks)
+        ~memory_pool_stack()
+        {
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            unregister_magazines();
+#endif
+        }
+
+        // ------------------------------------------------------------------------
+        bool allocate_pool(std::size_t num_chunks)
         {
+            if (num_chunks == 0)
+                return false;
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            latency_timer timer(grow_latency_);
+#endif
             GHEX_DP_ONLY(mps_deb,
-                trace(alloctools::debug::str<>(PoolType::desc()), "Allocating",
-                    "ChunkSize", alloctools::debug::hex<4>(ChunkSize), "num_chunks",
+                trace(alloctools::debug::str<>(desc()), "Allocating",
+                    "ChunkSize", alloctools::debug::hex<4>(chunk_size_), "num_chunks",
                     alloctools::debug::dec<>(num_chunks)));
 
-            // Allocate one very large registered block for N small blocks
-            region_ptr block = Allocator().malloc(pd_, ChunkSize * num_chunks);
-
-            // store a copy of this to make sure it is 'alive'
-            block_list_[block->get_address()] = block;
-
-            // add this many chunks to the tracking totals
-            in_use_ += num_chunks;
-            chunks_avail_ += num_chunks;
-            region_list_.reserve(chunks_avail_);
+            // Allocate one very large registered block for N small blocks,
+            // it may be bigger than requested if it was rounded up to pages
+            region_ptr block = Allocator().malloc(
+                pd_, chunk_size_ * num_chunks, numa_node_, page_policy_);
+            num_chunks = (std::max)(num_chunks, block->get_size() / chunk_size_);
+            std::unique_ptr<slab> new_slab = take_retired(num_chunks);
+            if (new_slab)
+            {
+                new_slab->block_ = std::move(block);
+                new_slab->rebind_descriptors(num_chunks, chunk_size_);
+            }
+            else
+            {
+                new_slab.reset(new slab(num_chunks));
+                new_slab->block_ = std::move(block);
+                // break the large region into N small regions
+                new_slab->create_descriptors(chunk_size_);
+            }
 
-            // break the large region into N small regions
-            uint64_t offset = 0;
+            // publish the slab (the directory keeps the block 'alive')
+            // before any of its regions can be popped by another thread
+            new_slab->free_chunks_ = num_chunks;
+            new_slab->idle_since_ = now_ns();
+            uint32_t index = uint32_t(slab_list_.append(new_slab.get()));
+            slab* published = new_slab.release();
+            // link the regions in address order as they are initialized
             for (std::size_t i = 0; i < num_chunks; ++i)
             {
-                // we must keep a copy of the sub-region since we only pass
-                // pointers to regions around the code.
-                region_type* new_region = new region_type_impl(block->get_region(),
-                    static_cast<char*>(block->get_base_address()) + offset,
-                    static_cast<char*>(block->get_base_address()), ChunkSize,
-                    region_type::BLOCK_PARTIAL);
-                region_list_.push_back(new_region);
-                GHEX_DP_ONLY(mps_deb,
-                    trace(alloctools::debug::str<>(PoolType::desc()), "Allocate Block",
-                        alloctools::debug::dec<>(i), new_region));
-                // push the pointer onto our stack
-                push(new_region);
-                offset += ChunkSize;
+                region_type* r = published->region(i);
+                r->set_size_class(size_class_);
+                r->set_numa_node(uint32_t((std::max)(numa_node_, 0)));
+                r->set_slab_index(index);
+                r->next_.store(
+                    (i + 1 < num_chunks) ? published->region(i + 1) : nullptr,
+                    std::memory_order_relaxed);
+            }
+            published->span_ = slab_span{
+                static_cast<char*>(published->block_->get_base_address()),
+                chunk_size_, num_chunks,
+                reinterpret_cast<char*>(published->region(0)),
+                sizeof(region_type_impl)};
+            if (page_map_ != nullptr)
+            {
+                page_map_->insert(&published->span_);
             }
+            chunks_avail_ += num_chunks;
+            ++grow_count_;
+
+            // new regions go straight onto the shared free list
+            // (not the magazine of whichever thread is growing the stack)
+            free_list_.push_chain(
+                published->region(0), published->region(num_chunks - 1));
+            free_count_ += num_chunks;
             return true;
         }
 
+        // ------------------------------------------------------------------------
+        // called by the refill worker, grow the stack up to the high watermark
+        void refill()
+        {
+            // clear the flag first so that pops that drop below the low
+            // watermark while we are allocating can request another refill
+            refill_pending_.store(false, std::memory_order_release);
+            // the free count only means something once a trim is done
+            while ((trim_epoch_.load(std::memory_order_acquire) & 1) != 0)
+            {
+                std::this_thread::yield();
+            }
+            std::ptrdiff_t free = free_count_.load(std::memory_order_relaxed);
+            if (free < std::ptrdiff_t(high_watermark_))
+            {
+                allocate_pool(high_watermark_ - free);
+            }
+        }
+
+        // ------------------------------------------------------------------------
+        // attach (or detach with nullptr) a background refill worker
+        void set_refill_worker(refill_worker_type* worker)
+        {
+            refill_worker_ = worker;
+        }
+
+        // ------------------------------------------------------------------------
+        // add the chunks of all (current and future) slabs to an address map
+        void set_page_map(page_map* map)
+        {
+            page_map_ = map;
+            slab_list_.for_each([map](slab* s) { map->insert(&s->span_); });
+        }
+
+        // ------------------------------------------------------------------------
+        // number of free chunks below which a background refill is requested
+        // and the number the stack is grown back up to
+        void set_watermarks(std::size_t low, std::size_t high)
+        {
+            low_watermark_ = low;
+            high_watermark_ = (std::max)(high, (std::max)(low, std::size_t(1)));
+        }
+
+        std::size_t low_watermark() const
+        {
+            return low_watermark_;
+        }
+
+        std::size_t high_watermark() const
+        {
+            return high_watermark_;
+        }
+
+        // ------------------------------------------------------------------------
+        // time taken to allocate and register new slabs, and the number of
+        // failed CAS operations on the shared free list (both empty unless
+        // ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS is defined)
+        latency_snapshot grow_latency() const
+        {
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            return grow_latency_.snapshot();
+#else
+            return latency_snapshot();
+#endif
+        }
+
+        std::uint64_t cas_retries() const
+        {
+            return free_list_.cas_retries();
+        }
+
+        void reset_latency_histograms()
+        {
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            grow_latency_.reset();
+#endif
+        }
+
+        // ------------------------------------------------------------------------
+        // return any regions cached by the calling thread to the shared free
+        // list (so that their slabs may be released), a no-op without caching
+        void flush_local_cache()
+        {
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            magazine_type& mag = local_magazine();
+            if (!mag.empty())
+            {
+                flush_regions(this, mag.regions_, mag.count_);
+                mag.count_ = 0;
+            }
+#endif
+        }
+
+        // ------------------------------------------------------------------------
+        // bytes of registered memory currently held by this stack
+        std::size_t registered_bytes() const
+        {
+            return chunks_avail_.load(std::memory_order_relaxed) * chunk_size_;
+        }
+
+        // ------------------------------------------------------------------------
+        // Release slabs whose chunks are all on the free list and that have been
+        // idle since (at least) idle_before (steady clock ns), stopping once
+        // max_bytes have been released. Returns the number of bytes released.
+        // If another thread is currently growing or trimming, nothing is done.
+        std::size_t release_slabs(std::size_t max_bytes, std::int64_t idle_before)
+        {
+            if (max_bytes == 0 || growing_.exchange(true, std::memory_order_acquire))
+            {
+                return 0;
+            }
+            std::size_t released = 0;
+            // select candidate slabs from the occupancy counters
+            std::vector<slab*> candidates;
+            std::size_t candidate_bytes = 0;
+            slab_list_.for_each([&](slab* s) {
+                if (candidate_bytes < max_bytes &&
+                    s->free_chunks_.load(std::memory_order_acquire) ==
+                        s->num_chunks_ &&
+                    s->idle_since_.load(std::memory_order_relaxed) <= idle_before)
+                {
+                    s->trim_count_ = 0;
+                    candidates.push_back(s);
+                    candidate_bytes += s->num_chunks_ * chunk_size_;
+                }
+            });
+
+            if (!candidates.empty())
+            {
+                // take everything off the free list, threads that find the
+                // stack empty meanwhile wait for us (see trim_epoch_)
+                trim_epoch_.fetch_add(1, std::memory_order_acq_rel);
+                std::vector<region_type*> drained;
+                region_type* region = nullptr;
+                while (free_list_pop(region))
+                {
+                    drained.push_back(region);
+                    ++slab_of(region)->trim_count_;
+                }
+                // a candidate is only released if we hold every one of its chunks
+                std::vector<region_type*> keep;
+                keep.reserve(drained.size());
+                for (auto r : drained)
+                {
+                    slab* s = slab_of(r);
+                    if (s->trim_count_ != s->num_chunks_ ||
+                        !is_candidate(candidates, s))
+                    {
+                        keep.push_back(r);
+                    }
+                }
+                // the chunks were free before, so the idle time of their
+                // slabs is left as it was
+                if (!keep.empty())
+                {
+                    free_list_restore(keep.data(), keep.data() + keep.size());
+                }
+                trim_epoch_.fetch_add(1, std::memory_order_acq_rel);
+                for (slab* s : candidates)
+                {
+                    if (s->trim_count_ == s->num_chunks_)
+                    {
+                        GHEX_DP_ONLY(mps_deb,
+                            debug(alloctools::debug::str<>(desc()),
+                                "Releasing slab", *s->block_));
+                        if (page_map_ != nullptr)
+                        {
+                            page_map_->erase(&s->span_);
+                        }
+                        // the block and size are taken first, once retired
+                        // the slab may be reused by a refill at any time
+                        region_ptr block = std::move(s->block_);
+                        const std::size_t num_chunks = s->num_chunks_;
+                        // free the directory slot but keep the slab and its
+                        // descriptors, a concurrent pop may still read their
+                        // next_ link
+                        {
+                            std::lock_guard<std::mutex> lock(retired_mutex_);
+                            retired_.emplace_back(slab_list_.remove(
+                                s->region(0)->get_slab_index()));
+                        }
+                        // deregisters and frees the memory
+                        Allocator::free(std::move(block));
+                        chunks_avail_ -= num_chunks;
+                        ++slab_release_count_;
+                        released += num_chunks * chunk_size_;
+                    }
+                }
+            }
+            growing_.store(false, std::memory_order_release);
+            return released;
+        }
+
+        // ------------------------------------------------------------------------
+        // how often a pop found the stack empty and had to take the slow path
+        std::size_t slow_path_count() const
+        {
+            return slow_path_count_.load(std::memory_order_relaxed);
+        }
+
         // ------------------------------------------------------------------------
         void DeallocatePool()
         {
             if (in_use_ != 0)
             {
                 GHEX_DP_ONLY(mps_err,
-                    trace(alloctools::debug::str<>(PoolType::desc()),
+                    trace(alloctools::debug::str<>(desc()),
                         "Deallocating free_list : Not all blocks were returned",
                         "refcounts", alloctools::debug::dec<>(in_use_)));
             }
-#ifdef RMA_POOL_DEBUG_SET
-            for (auto region : region_set_)
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            outstanding_report report;
+            outstanding(report, (std::numeric_limits<std::size_t>::max)());
+            for (auto const& r : report.regions)
             {
-                mps_err.error("Items remaining in set are ", *region);
+                GHEX_DP_ONLY(mps_err,
+                    error(alloctools::debug::str<>(desc()), "Not returned",
+                        alloctools::debug::ptr(r.address), "age (ns)",
+                        alloctools::debug::dec<>(r.age_ns), "call site",
+                        alloctools::debug::ptr(r.call_site)));
             }
+#endif
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            // regions cached by other threads become stale and are
+            // discarded by those threads, they are deleted below
+            unregister_magazines();
 #endif
             region_type* region = nullptr;
             while (free_list_.pop(region))
             {
                 // clear our stack, we don't need to delete the regions
                 // because they are only copies of pointers held by
-                // the region_list_
+                // the slabs
             }
+            free_count_ = 0;
 
-            // delete the regions - better to delete them here than when clearing
-            // the stack above in case some were not released by the user
-            for (auto r : region_list_)
+            if (page_map_ != nullptr)
             {
-                delete r;
+                slab_list_.for_each(
+                    [this](slab* s) { page_map_->erase(&s->span_); });
             }
-            region_list_.clear();
 
-            // release references to shared arrays
-            block_list_.clear();
+            // delete the slabs, their regions and release the blocks
+            // - better to delete them here than when clearing
+            // the stack above in case some were not released by the user
+            slab_list_.clear();
+            {
+                std::lock_guard<std::mutex> lock(retired_mutex_);
+                retired_.clear();
+            }
+            chunks_avail_ = 0;
         }
 
         // ------------------------------------------------------------------------
         inline void push(region_type* region)
         {
-#ifdef RMA_POOL_DEBUG_SET
-            {
-                std::lock_guard<std::mutex> l(set_mutex_);
-                region_set_.erase(region);
-            }
-#endif
+            if (!track_released(region))
+                return;
             GHEX_DP_ONLY(mps_deb,
-                trace(alloctools::debug::str<>(PoolType::desc()), "Push block",
+                trace(alloctools::debug::str<>(desc()), "Push block",
                     *region, "Used", alloctools::debug::dec<>(in_use_ - 1), "Accesses",
                     alloctools::debug::dec<>(accesses_)));
 
@@ -193,59 +586,438 @@ namespace alloctools { namespace rma { namespace detail {
             {
                 uintptr_t val = uintptr_t(region->get_address());
                 GHEX_DP_ONLY(mps_deb,
-                    trace(alloctools::debug::str<>(PoolType::desc()),
+                    trace(alloctools::debug::str<>(desc()),
                         "Writing 0xdeadbeef to region address",
                         alloctools::debug::ptr(val)));
                 if (region->get_address() != nullptr)
                 {
                     // get use the pointer to the region
                     uintptr_t* ptr = reinterpret_cast<uintptr_t*>(val);
-                    for (unsigned int c = 0; c < ChunkSize / 8; ++c)
+                    for (unsigned int c = 0; c < chunk_size_ / 8; ++c)
                     {
                         ptr[c] = 0xdeadbeef;
                     }
                 }
             }
 
-            if (!free_list_.push(region))
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            magazine_type& mag = local_magazine();
+            if (mag.full())
             {
-                mps_err.error(
-                    PoolType::desc(), "Error in memory pool push", *region);
+                flush_magazine(mag);
             }
+            mag.push(region);
+#else
+            free_list_push(region);
+#endif
             // decrement one reference
             --in_use_;
         }
 
         // ------------------------------------------------------------------------
-        inline region_type* pop()
+        // push a batch of regions with a single CAS on the free list
+        // (after filling the thread cache when it is enabled)
+        void push(region_type** begin, region_type** end)
         {
-            // get a block
-            region_type* region = nullptr;
-            if (!free_list_.pop(region))
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            // regions returned twice are dropped from the batch
+            region_type** kept = begin;
+            for (region_type** r = begin; r != end; ++r)
             {
-                GHEX_DP_ONLY(mps_deb,
-                    error(alloctools::debug::str<>(PoolType::desc()),
-                        "Retry : memory pool pop - increasing allocation"));
-                // we must allocate some more memory
-                allocate_pool(in_use_);
-                return nullptr;
+                if (track_released(*r))
+                    *kept++ = *r;
+            }
+            end = kept;
+#endif
+            GHEX_DP_ONLY(mps_deb,
+                trace(alloctools::debug::str<>(desc()), "Push batch",
+                    alloctools::debug::dec<>(end - begin), "Used",
+                    alloctools::debug::dec<>(in_use_ - (end - begin))));
+            const uint32_t count = uint32_t(end - begin);
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            magazine_type& mag = local_magazine();
+            while (begin != end && !mag.full())
+            {
+                mag.push(*begin++);
+            }
+#endif
+            if (begin != end)
+            {
+                free_list_push(begin, end);
+            }
+            in_use_ -= count;
+        }
+
+        // ------------------------------------------------------------------------
+        // pop up to n regions into out, the shared free list is popped with
+        // a single CAS and the watermark is checked once. Regions missing
+        // after that are popped one at a time (growing the stack if allowed).
+        // returns the number of regions popped
+        std::size_t pop(region_type** out, std::size_t n, bool grow = true)
+        {
+            std::size_t count = 0;
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            magazine_type& mag = local_magazine();
+            while (count < n && !mag.empty())
+            {
+                out[count++] = mag.pop();
+            }
+#endif
+            if (count < n)
+            {
+                std::size_t popped = free_list_.pop(out + count, n - count);
+                free_count_ -= std::ptrdiff_t(popped);
+                for (std::size_t i = count; i < count + popped; ++i)
+                {
+                    slab_of(out[i])->free_chunks_.fetch_sub(
+                        1, std::memory_order_relaxed);
+                }
+                count += popped;
+                check_watermark();
+            }
+            in_use_ += uint32_t(count);
+            accesses_ += std::uint64_t(count);
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                track_allocated(out[i]);
+            }
+#endif
+            while (count < n)
+            {
+                region_type* region = pop(grow);
+                if (region == nullptr)
+                    break;
+                out[count++] = region;
+            }
+            GHEX_DP_ONLY(mps_deb,
+                trace(alloctools::debug::str<>(desc()), "Pop batch",
+                    alloctools::debug::dec<>(count), "Used",
+                    alloctools::debug::dec<>(in_use_)));
+            return count;
+        }
+
+        // ------------------------------------------------------------------------
+        // if grow is false an empty stack returns nullptr instead of growing
+        // (a background refill is still requested when a worker is attached)
+        inline region_type* pop(bool grow = true)
+        {
+            // get a block, if a trim held the free list meanwhile retry
+            const unsigned int epoch = trim_epoch_.load(std::memory_order_acquire);
+            region_type* region = pop_free();
+            if (region == nullptr &&
+                ((epoch & 1) != 0 ||
+                    trim_epoch_.load(std::memory_order_acquire) != epoch))
+            {
+                region = wait_for_trim();
+            }
+            if (region == nullptr)
+            {
+                if (!grow)
+                {
+                    check_watermark();
+                    return nullptr;
+                }
+                region = pop_slow();
+                if (region == nullptr)
+                {
+                    return nullptr;
+                }
             }
             ++in_use_;
             ++accesses_;
             GHEX_DP_ONLY(mps_deb,
-                trace(alloctools::debug::str<>(PoolType::desc()), "Pop block", *region,
+                trace(alloctools::debug::str<>(desc()), "Pop block", *region,
                     "Used", alloctools::debug::dec<>(in_use_), "Accesses",
                     alloctools::debug::dec<>(accesses_)));
+            track_allocated(region);
+            return region;
+        }
 
-#ifdef RMA_POOL_DEBUG_SET
+        // ------------------------------------------------------------------------
+        // take a region from the thread cache or shared free list without growing
+        inline region_type* pop_free()
+        {
+            region_type* region = nullptr;
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            magazine_type& mag = local_magazine();
+            if (mag.empty())
             {
-                std::lock_guard<std::mutex> l(set_mutex_);
-                region_set_.insert(region);
+                refill_magazine(mag);
+            }
+            if (!mag.empty())
+            {
+                region = mag.pop();
+            }
+#else
+            if (free_list_pop(region))
+            {
+                check_watermark();
             }
 #endif
             return region;
         }
 
+        // ------------------------------------------------------------------------
+        // true if the calling thread could pop a region without growing,
+        // regions cached in the magazines of other threads are not seen
+        bool has_free_unsafe()
+        {
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+            if (!local_magazine().empty())
+            {
+                return true;
+            }
+#endif
+            return !free_list_.empty();
+        }
+
+        // ------------------------------------------------------------------------
+        // All traffic on the shared free list goes through these so that the
+        // free count and the per slab occupancy are kept up to date.
+        // The slab of a region that is in use or on the free list is always
+        // in the directory, it is removed only after all its regions have
+        // been taken off the free list by release_slabs
+        inline slab* slab_of(region_type* region) const
+        {
+            return &slab_list_.published(region->get_slab_index());
+        }
+
+        inline bool free_list_pop(region_type*& region)
+        {
+            if (!free_list_.pop(region))
+            {
+                return false;
+            }
+            --free_count_;
+            slab_of(region)->free_chunks_.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        inline void mark_free(region_type* region)
+        {
+            slab* s = slab_of(region);
+            if (s->free_chunks_.fetch_add(1, std::memory_order_release) + 1 ==
+                s->num_chunks_)
+            {
+                s->idle_since_.store(now_ns(), std::memory_order_relaxed);
+            }
+        }
+
+        // the slab is updated before the region is pushed, once the region
+        // is on the free list its slab may be released and reused
+        inline void free_list_push(region_type* region)
+        {
+            mark_free(region);
+            free_list_.push(region);
+            ++free_count_;
+        }
+
+        void free_list_push(region_type** begin, region_type** end)
+        {
+            for (region_type** r = begin; r != end; ++r)
+            {
+                mark_free(*r);
+            }
+            free_list_.push(begin, end);
+            free_count_ += end - begin;
+        }
+
+        // put back regions that were taken off the free list without being
+        // used (when trimming), the slab idle times are not touched
+        void free_list_restore(region_type** begin, region_type** end)
+        {
+            for (region_type** r = begin; r != end; ++r)
+            {
+                slab_of(*r)->free_chunks_.fetch_add(1, std::memory_order_release);
+            }
+            free_list_.push(begin, end);
+            free_count_ += end - begin;
+        }
+
+        // ------------------------------------------------------------------------
+        // the retired slab with the fewest descriptors that holds num_chunks,
+        // nullptr if none does. Smaller retired slabs stay on the list for a
+        // later, smaller, slab (they cannot be freed, see release_slabs)
+        std::unique_ptr<slab> take_retired(std::size_t num_chunks)
+        {
+            std::lock_guard<std::mutex> lock(retired_mutex_);
+            auto best = retired_.end();
+            for (auto it = retired_.begin(); it != retired_.end(); ++it)
+            {
+                if ((*it)->capacity_ >= num_chunks &&
+                    (best == retired_.end() ||
+                        (*it)->capacity_ < (*best)->capacity_))
+                {
+                    best = it;
+                }
+            }
+            if (best == retired_.end())
+            {
+                return nullptr;
+            }
+            std::unique_ptr<slab> result = std::move(*best);
+            *best = std::move(retired_.back());
+            retired_.pop_back();
+            return result;
+        }
+
+        static bool is_candidate(std::vector<slab*> const& candidates, slab* s)
+        {
+            return std::find(candidates.begin(), candidates.end(), s) !=
+                candidates.end();
+        }
+
+        // ------------------------------------------------------------------------
+        // the stack is empty, if a refill worker is attached we ask it to grow
+        // the stack and return nullptr so that the caller can fall back to
+        // a temporary region, otherwise we grow the stack here and retry
+        region_type* pop_slow()
+        {
+            ++slow_path_count_;
+            if (refill_worker_ != nullptr)
+            {
+                GHEX_DP_ONLY(mps_deb,
+                    error(alloctools::debug::str<>(desc()),
+                        "Empty : memory pool pop - requesting refill"));
+                request_refill();
+                return nullptr;
+            }
+            // elect exactly one thread to grow the stack
+            if (!growing_.exchange(true, std::memory_order_acquire))
+            {
+                GHEX_DP_ONLY(mps_deb,
+                    error(alloctools::debug::str<>(desc()),
+                        "Retry : memory pool pop - increasing allocation"));
+                // we must allocate some more memory
+                region_type* region = nullptr;
+                try
+                {
+                    allocate_pool(high_watermark_);
+                    region = pop_free();
+                }
+                catch (...)
+                {
+                    growing_.store(false, std::memory_order_release);
+                    throw;
+                }
+                growing_.store(false, std::memory_order_release);
+                return region;
+            }
+            // another thread is growing the stack, wait for regions to appear
+            while (growing_.load(std::memory_order_acquire))
+            {
+                if (region_type* region = pop_free())
+                {
+                    return region;
+                }
+                std::this_thread::yield();
+            }
+            return pop_free();
+        }
+
+        // ------------------------------------------------------------------------
+        // release_slabs has taken the free list, wait until it has put back
+        // the chunks it keeps (the stack is only empty for that long).
+        // nullptr if the stack is empty without a trim running meanwhile
+        region_type* wait_for_trim()
+        {
+            for (;;)
+            {
+                const unsigned int epoch =
+                    trim_epoch_.load(std::memory_order_acquire);
+                if (region_type* region = pop_free())
+                {
+                    return region;
+                }
+                if ((epoch & 1) == 0 &&
+                    trim_epoch_.load(std::memory_order_acquire) == epoch)
+                {
+                    return nullptr;
+                }
+                std::this_thread::yield();
+            }
+        }
+
+        // ------------------------------------------------------------------------
+        // the free count is meaningless while a trim holds the free list
+        inline void check_watermark()
+        {
+            if (refill_worker_ != nullptr &&
+                (trim_epoch_.load(std::memory_order_relaxed) & 1) == 0 &&
+                free_count_.load(std::memory_order_relaxed) <
+                    std::ptrdiff_t(low_watermark_))
+            {
+                request_refill();
+            }
+        }
+
+        // ------------------------------------------------------------------------
+        inline void request_refill()
+        {
+            // only one refill request may be queued at a time
+            if (!refill_pending_.load(std::memory_order_relaxed) &&
+                !refill_pending_.exchange(true, std::memory_order_acquire))
+            {
+                refill_worker_->request_refill(this);
+            }
+        }
+
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+        // ------------------------------------------------------------------------
+        using magazine_type = region_magazine<ALLOCTOOLS_THREAD_CACHE_SIZE>;
+
+        inline magazine_type& local_magazine()
+        {
+            return thread_magazines<ALLOCTOOLS_THREAD_CACHE_SIZE>::local().get(
+                magazine_slot_, magazine_id_);
+        }
+
+        // ------------------------------------------------------------------------
+        // take a batch of regions from the shared free list
+        void refill_magazine(magazine_type& mag)
+        {
+            region_type* region = nullptr;
+            while (mag.count_ < magazine_type::batch_size() &&
+                free_list_pop(region))
+            {
+                mag.push(region);
+            }
+            check_watermark();
+        }
+
+        // ------------------------------------------------------------------------
+        // return the oldest (coldest) half of the magazine to the shared free
+        // list and keep the most recently used regions in the thread cache
+        void flush_magazine(magazine_type& mag)
+        {
+            const std::size_t n = magazine_type::batch_size();
+            flush_regions(this, mag.regions_, n);
+            std::copy(mag.regions_ + n, mag.regions_ + mag.count_, mag.regions_);
+            mag.count_ -= n;
+        }
+
+        // ------------------------------------------------------------------------
+        // push a batch of regions onto the free list, also used by the
+        // registry to return regions held by a thread when it exits
+        static void flush_regions(
+            void* stack, memory_region** regions, std::size_t count)
+        {
+            auto self = static_cast<memory_pool_stack*>(stack);
+            self->free_list_push(regions, regions + count);
+        }
+
+        // ------------------------------------------------------------------------
+        void unregister_magazines()
+        {
+            if (magazine_id_ != 0)
+            {
+                magazine_registry::instance().remove(magazine_slot_);
+                magazine_id_ = 0;
+            }
+        }
+
+#endif
         // ------------------------------------------------------------------------
         // at shutdown we might want to disregard any bocks still preposted as
         // we can't unpost them
@@ -254,40 +1026,206 @@ namespace alloctools { namespace rma { namespace detail {
             in_use_ -= N;
         }
 
+        // ------------------------------------------------------------------------
+        // remember where an allocated region was requested (for reports)
+        inline void set_call_site(region_type* region, void const* site)
+        {
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            track_record(region).site_.store(site, std::memory_order_relaxed);
+#else
+            (void) region;
+            (void) site;
+#endif
+        }
+
+        // ------------------------------------------------------------------------
+        // add the allocated regions of the stack to a report, keeping the
+        // max_entries oldest. Only the count is filled in unless
+        // ALLOCTOOLS_HAVE_REGION_TRACKING is defined, then the records of
+        // the slabs are scanned (without locking)
+        void outstanding(outstanding_report& report, std::size_t max_entries) const
+        {
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            report.count += tracker_.outstanding();
+            report.double_frees += tracker_.double_frees();
+            std::int64_t now = region_tracker::now_ns();
+            slab_list_.for_each([&](slab* s) {
+                for (std::size_t i = 0; i < s->num_chunks_; ++i)
+                {
+                    std::int64_t since =
+                        s->track_[i].since_.load(std::memory_order_relaxed);
+                    if (since != 0)
+                    {
+                        report.regions.push_back(outstanding_region{
+                            s->region(i)->get_address(), chunk_size_,
+                            (std::max)(now - since, std::int64_t(0)),
+                            s->track_[i].site_.load(std::memory_order_relaxed)});
+                    }
+                }
+                // keep the list short while scanning large stacks
+                if (report.regions.size() > 2 * max_entries + 1024)
+                {
+                    report.keep_oldest(max_entries);
+                }
+            });
+            report.keep_oldest(max_entries);
+#else
+            (void) max_entries;
+            std::size_t used = in_use_;
+            report.count += used;
+#endif
+        }
+
+        // ------------------------------------------------------------------------
+        // the counters of the stack, read without locking (see pool_statistics)
+        size_class_stats statistics() const
+        {
+            size_class_stats stats;
+            stats.size_class = size_class_;
+            stats.numa_node = numa_node_;
+            stats.chunk_size = chunk_size_;
+            std::size_t avail = chunks_avail_.load(std::memory_order_relaxed);
+            stats.free_chunks = std::size_t((std::max)(
+                free_count_.load(std::memory_order_relaxed), std::ptrdiff_t(0)));
+            stats.used_chunks = avail - (std::min)(stats.free_chunks, avail);
+            stats.accesses = accesses_;
+            std::size_t grown = grow_count_.load(std::memory_order_relaxed);
+            std::size_t released =
+                slab_release_count_.load(std::memory_order_relaxed);
+            stats.slabs = grown - (std::min)(released, grown);
+            stats.registered_bytes = avail * chunk_size_;
+            stats.slow_path_count = slow_path_count_.load(std::memory_order_relaxed);
+            stats.grow_count = grown;
+            stats.slab_releases = released;
+            return stats;
+        }
+
         // ------------------------------------------------------------------------
         // for debug log messages
         std::string status()
         {
             std::stringstream temp;
-            temp << "| " << PoolType::desc() << "ChunkSize "
-                 << alloctools::debug::hex<6>(ChunkSize) << " Free "
-                 << alloctools::debug::dec<>(chunks_avail_ - in_use_) << "Used "
+            temp << "| " << desc() << "ChunkSize "
+                 << alloctools::debug::hex<6>(chunk_size_) << " Free "
+                 << alloctools::debug::dec<>(free_count_.load()) << "Used "
                  << alloctools::debug::dec<>(in_use_) << "Accesses "
                  << alloctools::debug::dec<>(accesses_);
             return temp.str();
         }
 
         // ------------------------------------------------------------------------
-        constexpr std::size_t chunk_size() const
+        inline std::size_t chunk_size() const
+        {
+            return chunk_size_;
+        }
+
+        // ------------------------------------------------------------------------
+        inline uint32_t size_class() const
+        {
+            return size_class_;
+        }
+
+        // ------------------------------------------------------------------------
+        // the node memory is bound to, -1 if the stack is not NUMA aware
+        inline int numa_node() const
         {
-            return ChunkSize;
+            return numa_node_;
         }
 
         // ------------------------------------------------------------------------
-        // these are counters used for debugging that are usually optimized out
-        debug::performance_counter<unsigned int> accesses_;
-        debug::performance_counter<unsigned int> in_use_;
-        debug::performance_counter<unsigned int> chunks_avail_;
+        inline void track_allocated(region_type* region)
+        {
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            tracker_.allocated(track_record(region));
+#else
+            (void) region;
+#endif
+        }
+
+        // returns false for a region that was not allocated (a double free),
+        // it must not be pushed again. Only detected with region tracking
+        inline bool track_released(region_type* region)
+        {
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            if (!tracker_.released(track_record(region)))
+            {
+                GHEX_DP_ONLY(mps_err,
+                    error(alloctools::debug::str<>(desc()),
+                        "Region returned twice", *region));
+                return false;
+            }
+#else
+            (void) region;
+#endif
+            return true;
+        }
+
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+        inline region_track_record& track_record(region_type* region) const
+        {
+            slab* s = slab_of(region);
+            return s->track_[std::size_t(
+                static_cast<region_type_impl*>(region) - s->descriptors_)];
+        }
+#endif
+
+        // ------------------------------------------------------------------------
+        // name used as a prefix in debug log messages
+        inline const char* desc() const
+        {
+            return desc_.c_str();
+        }
+
+        // ------------------------------------------------------------------------
+        // these are counters used for debugging that are usually optimized out,
+        // when enabled they are sharded so that threads do not share a line
+        debug::sharded_counter<std::uint64_t> accesses_;
+        debug::sharded_counter<unsigned int> in_use_;
+        std::atomic<std::size_t> chunks_avail_;
+        // chunks on the shared free list (not counting thread caches)
+        std::atomic<std::ptrdiff_t> free_count_;
+        std::atomic<std::size_t> slow_path_count_;
+        std::atomic<std::size_t> grow_count_;
+        std::atomic<std::size_t> slab_release_count_;
+        std::size_t low_watermark_;
+        std::size_t high_watermark_;
+        std::atomic<bool> refill_pending_;
+        // set while one thread grows the stack synchronously (or trims it)
+        std::atomic<bool> growing_;
+        // incremented when release_slabs takes the chunks of the free list
+        // and again when it has put back those it keeps (odd while it holds
+        // them), so that a pop can tell if the stack was only empty then
+        std::atomic<unsigned int> trim_epoch_;
+        refill_worker_type* refill_worker_;
+        // optional address to region lookup the slabs are added to
+        page_map* page_map_;
         //
         domain_type* pd_;
-        std::unordered_map<const char*, region_ptr> block_list_;
-        std::vector<region_type*> region_list_;
-        // pool is dynamically sized and can grow if needed
-        bl::stack<region_type*, bl::fixed_sized<false>> free_list_;
-
-#ifdef RMA_POOL_DEBUG_SET
-        std::mutex set_mutex_;
-        std::set<region_type*> region_set_;
+        uint32_t size_class_;
+        std::size_t chunk_size_;
+        int numa_node_;
+        page_policy page_policy_;
+        std::string desc_;
+        // every slab allocated by this stack, safe to append concurrently
+        slab_directory<slab> slab_list_;
+        // released slabs, kept for their descriptors until they are reused
+        std::mutex retired_mutex_;
+        std::vector<std::unique_ptr<slab>> retired_;
+        // pool is dynamically sized and can grow if needed,
+        // the links live in the regions so push/pop never allocate
+        intrusive_stack free_list_;
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+        latency_histogram grow_latency_;
+#endif
+
+#ifdef ALLOCTOOLS_HAVE_THREAD_CACHE
+        // identification of this stack in the thread local magazine registry
+        std::uint64_t magazine_id_;
+        std::uint32_t magazine_slot_;
+#endif
+
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+        region_tracker tracker_;
 #endif
     };
 
@@ -0,0 +1,160 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+//
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <thread>
+
+#if defined(__linux) || defined(linux) || defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#define ALLOCTOOLS_HAVE_PSI
+#endif
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> psi_deb("PSI    ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // Watches the Linux pressure stall information (PSI) for memory and
+    // invokes a callback whenever tasks have been stalled waiting for memory
+    // for longer than stall within a window. The path may be the system wide
+    // /proc/pressure/memory or the memory.pressure file of a cgroup (v2).
+    // On other platforms (or kernels without PSI) start() returns false.
+    // --------------------------------------------------------------------
+    struct memory_pressure_watcher
+    {
+        using callback_type = std::function<void()>;
+
+        memory_pressure_watcher()
+          : fd_(-1)
+          , stop_(false)
+          , events_(0)
+        {
+        }
+
+        ~memory_pressure_watcher()
+        {
+            stop();
+        }
+
+        memory_pressure_watcher(memory_pressure_watcher const&) = delete;
+        memory_pressure_watcher& operator=(
+            memory_pressure_watcher const&) = delete;
+
+        // ------------------------------------------------------------------
+        // register a PSI trigger and start the watcher thread
+        bool start(callback_type callback,
+            std::string const& path = "/proc/pressure/memory",
+            std::chrono::microseconds stall = std::chrono::milliseconds(150),
+            std::chrono::microseconds window = std::chrono::seconds(2))
+        {
+#ifdef ALLOCTOOLS_HAVE_PSI
+            if (fd_ >= 0)
+                return false;
+            fd_ = ::open(path.c_str(), O_RDWR | O_NONBLOCK);
+            if (fd_ < 0)
+            {
+                psi_deb.debug("unable to open", path.c_str());
+                return false;
+            }
+            std::string trigger = "some " + std::to_string(stall.count()) +
+                " " + std::to_string(window.count());
+            if (::write(fd_, trigger.c_str(), trigger.size() + 1) < 0)
+            {
+                psi_deb.debug("unable to register trigger", trigger.c_str());
+                ::close(fd_);
+                fd_ = -1;
+                return false;
+            }
+            callback_ = std::move(callback);
+            stop_ = false;
+            thread_ = std::thread([this]() { run(); });
+            return true;
+#else
+            (void) callback;
+            (void) path;
+            (void) stall;
+            (void) window;
+            return false;
+#endif
+        }
+
+        // ------------------------------------------------------------------
+        void stop()
+        {
+            stop_ = true;
+            if (thread_.joinable())
+            {
+                thread_.join();
+            }
+#ifdef ALLOCTOOLS_HAVE_PSI
+            if (fd_ >= 0)
+            {
+                ::close(fd_);
+                fd_ = -1;
+            }
+#endif
+        }
+
+        // ------------------------------------------------------------------
+        // number of pressure events that have been handled
+        std::size_t events() const
+        {
+            return events_.load(std::memory_order_relaxed);
+        }
+
+    private:
+#ifdef ALLOCTOOLS_HAVE_PSI
+        void run()
+        {
+            while (!stop_)
+            {
+                // wake regularly to check for stop requests
+                struct pollfd fds;
+                fds.fd = fd_;
+                fds.events = POLLPRI;
+                int n = ::poll(&fds, 1, 100);
+                if (n <= 0)
+                    continue;
+                if (fds.revents & POLLERR)
+                {
+                    psi_deb.debug("trigger source is gone");
+                    break;
+                }
+                if (fds.revents & POLLPRI)
+                {
+                    ++events_;
+                    GHEX_DP_ONLY(psi_deb, debug("memory pressure event"));
+                    callback_();
+                }
+            }
+        }
+#endif
+
+        int fd_;
+        std::atomic<bool> stop_;
+        std::atomic<std::size_t> events_;
+        callback_type callback_;
+        std::thread thread_;
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -11,6 +11,7 @@
 #pragma once
 
 #include <alloctools/debugging/print.hpp>
+#include <alloctools/detail/backing_store.hpp>
 #include <alloctools/memory_region.hpp>
 #include <alloctools/traits/memory_region_traits.hpp>
 //
@@ -51,6 +52,36 @@ namespace alloctools { namespace rma { namespace detail {
           : memory_region(address, base_address, size, flags)
           , region_(region)
         {
+            cache_keys();
+        }
+
+        // --------------------------------------------------------------------
+        // a region inside an already registered parent region, the keys are
+        // shared with the parent rather than queried from the provider
+        memory_region_impl(memory_region_impl const& parent, char* address,
+            uint64_t size, uint32_t flags)
+          : memory_region(address, parent.get_base_address(), size, flags)
+          , region_(parent.region_)
+        {
+            keys_ = parent.keys_;
+        }
+
+        // --------------------------------------------------------------------
+        // reinitialize a partial region in place for another parent, next_
+        // is left alone since a stale pop of an intrusive_stack may read it
+        void rebind(memory_region_impl const& parent, char* address,
+            uint64_t size, uint32_t flags)
+        {
+            address_ = address;
+            base_addr_ = parent.get_base_address();
+            size_ = size;
+            flags_ = flags;
+            size_class_ = 0;
+            numa_node_ = 0;
+            slab_index_ = 0;
+            used_space_ = 0;
+            region_ = parent.region_;
+            keys_ = parent.keys_;
         }
 
         // --------------------------------------------------------------------
@@ -77,22 +108,39 @@ namespace alloctools { namespace rma { namespace detail {
             }
             else
             {
+                cache_keys();
                 memr_deb.trace("OK registering region ",
                     alloctools::debug::ptr(buffer), alloctools::debug::ptr(address_), "desc ",
-                    alloctools::debug::ptr(fi_mr_desc(region_)), "rkey ",
-                    alloctools::debug::ptr(fi_mr_key(region_)), "length ",
-                    alloctools::debug::hex<6>(size_));
+                    alloctools::debug::ptr(get_local_key()), "rkey ",
+                    alloctools::debug::ptr(get_remote_key()), "length ",
+                    alloctools::debug::hex<6>(get_size()));
             }
         }
 
         // --------------------------------------------------------------------
-        // allocate a block of size length and register it
-        int allocate(provider_domain* pd, uint64_t length)
+        // allocate a block of size length and register it,
+        // unless the policy is heap the memory is mapped with the requested
+        // page size (or the largest available smaller one), if numa_node >= 0
+        // the pages are bound to that node. Mapped lengths are rounded up to
+        // whole pages (see get_size). If nothing can be mapped the memory
+        // comes from the heap as usual
+        int allocate(provider_domain* pd, uint64_t length, int numa_node = -1,
+            page_policy policy = page_policy::heap)
         {
             // Allocate storage for the memory region.
-            void* buffer = new char[length];
+            std::size_t mapped = length;
+            void* buffer = backing_store::allocate(mapped, policy, numa_node);
             if (buffer != nullptr)
             {
+                length = mapped;
+                set_mapped_region();
+                memr_deb.trace("mapped storage for memory region ",
+                    to_string(policy), "node ", alloctools::debug::dec<>(numa_node),
+                    alloctools::debug::hex<4>(length));
+            }
+            if (buffer == nullptr)
+            {
+                buffer = new char[length];
                 memr_deb.trace(
                     "allocated storage for memory region with malloc OK ",
                     alloctools::debug::hex<4>(length));
@@ -115,11 +163,12 @@ namespace alloctools { namespace rma { namespace detail {
             }
             else
             {
+                cache_keys();
                 memr_deb.trace("OK registering region ",
                     alloctools::debug::ptr(buffer), alloctools::debug::ptr(address_), "desc ",
-                    alloctools::debug::ptr(fi_mr_desc(region_)), "rkey ",
-                    alloctools::debug::ptr(fi_mr_key(region_)), "length ",
-                    alloctools::debug::hex<6>(size_));
+                    alloctools::debug::ptr(get_local_key()), "rkey ",
+                    alloctools::debug::ptr(get_remote_key()), "length ",
+                    alloctools::debug::hex<6>(get_size()));
             }
 
             memr_deb.trace("allocated/registered memory region ",
@@ -134,9 +183,10 @@ namespace alloctools { namespace rma { namespace detail {
         // destroy the region and memory according to flag settings
         ~memory_region_impl()
         {
-            if (get_partial_region())
-                return;
-            release();
+            if (!get_partial_region())
+                release();
+            if ((flags_ & BLOCK_KEYS) == BLOCK_KEYS)
+                delete keys_;
         }
 
         // --------------------------------------------------------------------
@@ -150,7 +200,8 @@ namespace alloctools { namespace rma { namespace detail {
                     alloctools::debug::ptr(get_local_key()));
                 // get these before deleting/unregistering (for logging)
                 const void* buffer = get_base_address();
-                auto length = memr_deb.declare_variable<uint64_t>(get_size());
+                const uint64_t size = get_size();
+                auto length = memr_deb.declare_variable<uint64_t>(size);
                 (void) length;
                 //
                 if (traits::rma_memory_region_traits<
@@ -166,31 +217,24 @@ namespace alloctools { namespace rma { namespace detail {
                         alloctools::debug::ptr(buffer), "with length ",
                         alloctools::debug::hex<6>(length));
                 }
-                if (!get_user_region())
+                if (get_mapped_region())
+                {
+                    backing_store::release(const_cast<void*>(buffer), size);
+                }
+                else if (!get_user_region())
                 {
                     delete[](static_cast<const char*>(buffer));
                 }
                 region_ = nullptr;
+                if ((flags_ & BLOCK_KEYS) == BLOCK_KEYS)
+                {
+                    keys_->local_key_ = nullptr;
+                    keys_->remote_key_ = 0;
+                }
             }
             return 0;
         }
 
-        // --------------------------------------------------------------------
-        // Get the local descriptor of the memory region.
-        virtual void* get_local_key(void) const
-        {
-            return traits::rma_memory_region_traits<
-                RegionProvider>::get_local_key(region_);
-        }
-
-        // --------------------------------------------------------------------
-        // Get the remote key of the memory region.
-        virtual uint64_t get_remote_key(void) const
-        {
-            return traits::rma_memory_region_traits<
-                RegionProvider>::get_remote_key(region_);
-        }
-
         // --------------------------------------------------------------------
         // return the underlying infiniband region handle
         inline provider_region* get_region() const
@@ -199,6 +243,26 @@ namespace alloctools { namespace rma { namespace detail {
         }
 
     private:
+        // --------------------------------------------------------------------
+        // read the descriptor and key from the provider once, after that
+        // they are plain loads (see memory_region::get_local_key). They are
+        // stored out of line so that partial regions can share them
+        void cache_keys()
+        {
+            if (region_ != nullptr)
+            {
+                if ((flags_ & BLOCK_KEYS) != BLOCK_KEYS)
+                {
+                    keys_ = new region_keys;
+                    flags_ |= BLOCK_KEYS;
+                }
+                keys_->local_key_ = traits::rma_memory_region_traits<
+                    RegionProvider>::get_local_key(region_);
+                keys_->remote_key_ = traits::rma_memory_region_traits<
+                    RegionProvider>::get_remote_key(region_);
+            }
+        }
+
         // The internal network type dependent memory region handle
         provider_region* region_;
     };
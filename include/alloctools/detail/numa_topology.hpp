@@ -0,0 +1,188 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+//
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux) || defined(linux) || defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define ALLOCTOOLS_HAVE_NUMA_SYSCALLS
+#endif
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> numa_deb("NUMA   ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // Minimal NUMA support that does not depend on libnuma. The topology
+    // is read once from sysfs, the current node of a thread is looked up
+    // from its cpu (sched_getcpu is a vDSO call on Linux) and cached for a
+    // number of calls since threads that use NUMA pools are usually pinned.
+    // On systems without sysfs NUMA information a single node is reported.
+    //
+    // Node ids need not be contiguous (nodes may be offline or absent), so
+    // the library works with node indices 0..num_nodes()-1 in the order of
+    // the ids, node_id translates an index to the id the kernel expects.
+    // --------------------------------------------------------------------
+    struct numa_topology
+    {
+        static numa_topology const& instance()
+        {
+            static numa_topology topo;
+            return topo;
+        }
+
+        std::size_t num_nodes() const
+        {
+            return node_ids_.size();
+        }
+
+        // the kernel id of the node with the given index
+        int node_id(std::size_t index) const
+        {
+            return index < node_ids_.size() ? node_ids_[index] : 0;
+        }
+
+        // the index of the node a cpu belongs to (0 if unknown)
+        int node_of_cpu(int cpu) const
+        {
+            if (cpu < 0 || std::size_t(cpu) >= cpu_to_node_.size())
+                return 0;
+            return cpu_to_node_[std::size_t(cpu)];
+        }
+
+        // ------------------------------------------------------------------
+        // the node index of the calling thread, refreshed every 256 calls
+        static int current_node()
+        {
+#ifdef ALLOCTOOLS_HAVE_NUMA_SYSCALLS
+            static thread_local int node = -1;
+            static thread_local unsigned int calls = 0;
+            if (node < 0 || (++calls & 0xff) == 0)
+            {
+                node = instance().node_of_cpu(sched_getcpu());
+            }
+            return node;
+#else
+            return 0;
+#endif
+        }
+
+        // ------------------------------------------------------------------
+        // Bind the pages of a page aligned range (that has not been touched
+        // yet) to the node with the given index. If the binding fails the
+        // kernel default policy applies, which is not an error.
+        static void bind(void* addr, std::size_t length, int index)
+        {
+#if defined(ALLOCTOOLS_HAVE_NUMA_SYSCALLS) && defined(SYS_mbind)
+            int node = instance().node_id(std::size_t(index));
+            // MPOL_BIND = 2, MPOL_MF_MOVE = 2
+            const std::size_t bits = 8 * sizeof(unsigned long);
+            std::vector<unsigned long> mask(std::size_t(node) / bits + 1, 0);
+            mask[std::size_t(node) / bits] |= 1ul << (std::size_t(node) % bits);
+            if (syscall(SYS_mbind, addr, length, 2, mask.data(),
+                    mask.size() * bits + 1, 2) != 0)
+            {
+                numa_deb.debug(
+                    "mbind failed for node", alloctools::debug::dec<>(node));
+            }
+#else
+            (void) addr;
+            (void) length;
+            (void) index;
+#endif
+        }
+
+    private:
+        numa_topology()
+        {
+#ifdef ALLOCTOOLS_HAVE_NUMA_SYSCALLS
+            long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+            cpu_to_node_.assign(ncpus > 0 ? std::size_t(ncpus) : 1, 0);
+            // the ids of the online nodes, in ascending order
+            std::ifstream online("/sys/devices/system/node/online");
+            std::string ids;
+            if (online.good())
+            {
+                std::getline(online, ids);
+            }
+            for_each_in_list(ids, [this](int id) {
+                std::ifstream cpulist("/sys/devices/system/node/node" +
+                    std::to_string(id) + "/cpulist");
+                if (!cpulist.good())
+                    return;
+                std::string list;
+                std::getline(cpulist, list);
+                int index = int(node_ids_.size());
+                node_ids_.push_back(id);
+                for_each_in_list(list, [this, index](int cpu) {
+                    if (std::size_t(cpu) >= cpu_to_node_.size())
+                        cpu_to_node_.resize(std::size_t(cpu) + 1, 0);
+                    cpu_to_node_[std::size_t(cpu)] = index;
+                });
+            });
+#endif
+            if (node_ids_.empty())
+            {
+                node_ids_.push_back(0);
+            }
+        }
+
+        // call f for every number of a sysfs list such as "0-7,16-23"
+        template <typename F>
+        static void for_each_in_list(std::string const& list, F&& f)
+        {
+            std::size_t pos = 0;
+            while (pos < list.size())
+            {
+                std::size_t end = list.find(',', pos);
+                if (end == std::string::npos)
+                    end = list.size();
+                std::string range = list.substr(pos, end - pos);
+                std::size_t dash = range.find('-');
+                int first = 0;
+                int last = -1;
+                try
+                {
+                    first = std::stoi(range.substr(0, dash));
+                    last = dash == std::string::npos ?
+                        first :
+                        std::stoi(range.substr(dash + 1));
+                }
+                catch (...)
+                {
+                }
+                for (int i = first; i <= last; ++i)
+                {
+                    f(i);
+                }
+                pos = end + 1;
+            }
+        }
+
+        // kernel node id of each node index
+        std::vector<int> node_ids_;
+        // node index of each cpu
+        std::vector<int> cpu_to_node_;
+    };
+
+}}}    // namespace alloctools::rma::detail
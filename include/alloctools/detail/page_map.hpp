@@ -0,0 +1,389 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/memory_region.hpp>
+//
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // The chunks of a pool slab as seen by the page map, the chunk holding
+    // an address is found by dividing its offset by the chunk size, its
+    // descriptor is found in the slab's contiguous descriptor array.
+    // --------------------------------------------------------------------
+    struct slab_span
+    {
+        char* base_;
+        std::size_t chunk_size_;
+        std::size_t num_chunks_;
+        // the first descriptor and the distance between descriptors
+        char* descriptors_;
+        std::size_t stride_;
+
+        inline memory_region* find(std::uintptr_t addr) const
+        {
+            std::size_t index = std::size_t(
+                (addr - reinterpret_cast<std::uintptr_t>(base_)) / chunk_size_);
+            return (index < num_chunks_) ?
+                reinterpret_cast<memory_region*>(descriptors_ + index * stride_) :
+                nullptr;
+        }
+    };
+
+    // --------------------------------------------------------------------
+    // The blocks of a buddy arena as seen by the page map. A block of order
+    // k starts at a min block index that is a multiple of 2^k and orders_
+    // holds k+1 at the first min block of every allocated block (0 for the
+    // others), so the block holding an address is found by clearing the
+    // low bits of its min block index until an allocated block of that
+    // order starts there.
+    // --------------------------------------------------------------------
+    struct arena_span
+    {
+        char* base_;
+        unsigned int min_shift_;
+        std::size_t max_order_;
+        std::atomic<std::uint8_t> const* orders_;
+        // the first descriptor and the distance between descriptors
+        char* descriptors_;
+        std::size_t stride_;
+
+        inline memory_region* find(std::uintptr_t addr) const
+        {
+            std::size_t index = std::size_t(
+                (addr - reinterpret_cast<std::uintptr_t>(base_)) >> min_shift_);
+            if (index >= (std::size_t(1) << max_order_))
+                return nullptr;
+            for (std::size_t k = 0; k <= max_order_; ++k)
+            {
+                std::size_t first = index & ~((std::size_t(1) << k) - 1);
+                if (orders_[first].load(std::memory_order_acquire) == k + 1)
+                {
+                    return reinterpret_cast<memory_region*>(
+                        descriptors_ + first * stride_);
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    // --------------------------------------------------------------------
+    // A map from any address to the memory region containing it.
+    // It is a three level radix tree indexed by page number (48 bit virtual
+    // addresses, 4K pages, 12 bits per level), interior nodes are created
+    // on demand with a CAS and are only freed when the map is destroyed,
+    // so lookups need no locks and cost three dependent loads.
+    //
+    // Each page holds one tagged word: either a memory_region (temporary
+    // and user regions), a slab_span (pool slabs, whose chunks may be
+    // smaller than a page) or an arena_span (the large object arena, which
+    // is mapped once rather than per block). A page that is shared by several regions holds
+    // shared_tag instead, its candidates are kept in a side table and a
+    // lookup on such a page takes a mutex and returns the candidate that
+    // contains the address. Insert and erase are serialized by the same
+    // mutex, an entry is removed once per insert, so regions sharing a page
+    // may be added and removed in any order.
+    // --------------------------------------------------------------------
+    struct page_map
+    {
+        static constexpr unsigned int page_shift = 12;
+        static constexpr unsigned int level_bits = 12;
+        static constexpr unsigned int address_bits = 48;
+        static constexpr std::size_t level_size = std::size_t(1) << level_bits;
+        static constexpr std::uintptr_t slab_tag = 1;
+        static constexpr std::uintptr_t arena_tag = 2;
+        static constexpr std::uintptr_t shared_tag = 3;
+        static constexpr std::uintptr_t tag_mask = 3;
+
+        page_map()
+          : root_(new root_type())
+        {
+            for (auto& entry : *root_)
+            {
+                entry.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~page_map()
+        {
+            for (auto& m : *root_)
+            {
+                mid_type* mid = m.load(std::memory_order_relaxed);
+                if (mid == nullptr)
+                    continue;
+                for (auto& l : *mid)
+                {
+                    delete l.load(std::memory_order_relaxed);
+                }
+                delete mid;
+            }
+            delete root_;
+        }
+
+        page_map(page_map const&) = delete;
+        page_map& operator=(page_map const&) = delete;
+
+        // ------------------------------------------------------------------
+        // map every page of [addr, addr+length) to a region / slab
+        void insert(memory_region* region)
+        {
+            set(region->get_address(), region->get_size(),
+                reinterpret_cast<std::uintptr_t>(region));
+        }
+
+        void insert(slab_span const* span)
+        {
+            set(span->base_, span->chunk_size_ * span->num_chunks_,
+                reinterpret_cast<std::uintptr_t>(span) | slab_tag);
+        }
+
+        void insert(arena_span const* span)
+        {
+            set(span->base_, std::size_t(1) << (span->max_order_ + span->min_shift_),
+                reinterpret_cast<std::uintptr_t>(span) | arena_tag);
+        }
+
+        // map only the page holding addr to a region
+        void insert(const void* addr, memory_region* region)
+        {
+            set(addr, 1, reinterpret_cast<std::uintptr_t>(region));
+        }
+
+        // ------------------------------------------------------------------
+        // unmap the pages of a region / slab (pages shared with other
+        // regions keep resolving to those)
+        void erase(memory_region* region)
+        {
+            clear(region->get_address(), region->get_size(),
+                reinterpret_cast<std::uintptr_t>(region));
+        }
+
+        void erase(slab_span const* span)
+        {
+            clear(span->base_, span->chunk_size_ * span->num_chunks_,
+                reinterpret_cast<std::uintptr_t>(span) | slab_tag);
+        }
+
+        void erase(arena_span const* span)
+        {
+            clear(span->base_, std::size_t(1) << (span->max_order_ + span->min_shift_),
+                reinterpret_cast<std::uintptr_t>(span) | arena_tag);
+        }
+
+        // undo insert(addr, region)
+        void erase(const void* addr, memory_region* region)
+        {
+            clear(addr, 1, reinterpret_cast<std::uintptr_t>(region));
+        }
+
+        // ------------------------------------------------------------------
+        // the region containing addr, or nullptr
+        inline memory_region* lookup(const void* addr) const
+        {
+            std::uintptr_t a = reinterpret_cast<std::uintptr_t>(addr);
+            if ((a >> address_bits) != 0)
+                return nullptr;
+            std::uintptr_t page = a >> page_shift;
+            mid_type* mid = (*root_)[top_index(page)].load(std::memory_order_acquire);
+            if (mid == nullptr)
+                return nullptr;
+            leaf_type* leaf = (*mid)[mid_index(page)].load(std::memory_order_acquire);
+            if (leaf == nullptr)
+                return nullptr;
+            std::atomic<std::uintptr_t> const& e = (*leaf)[leaf_index(page)];
+            std::uintptr_t value = e.load(std::memory_order_acquire);
+            if (value == shared_tag)
+            {
+                return lookup_shared(e, page, a);
+            }
+            return resolve(value, a);
+        }
+
+    private:
+        // ------------------------------------------------------------------
+        // the region of a (non shared) page word that contains a
+        static inline memory_region* resolve(std::uintptr_t value, std::uintptr_t a)
+        {
+            if ((value & tag_mask) == slab_tag)
+            {
+                return reinterpret_cast<slab_span const*>(value & ~tag_mask)
+                    ->find(a);
+            }
+            if ((value & tag_mask) == arena_tag)
+            {
+                return reinterpret_cast<arena_span const*>(value & ~tag_mask)
+                    ->find(a);
+            }
+            memory_region* region = reinterpret_cast<memory_region*>(value);
+            if (region != nullptr &&
+                (a < reinterpret_cast<std::uintptr_t>(region->get_address()) ||
+                    a >= reinterpret_cast<std::uintptr_t>(region->get_address()) +
+                            region->get_size()))
+            {
+                return nullptr;
+            }
+            return region;
+        }
+
+        memory_region* lookup_shared(std::atomic<std::uintptr_t> const& e,
+            std::uintptr_t page, std::uintptr_t a) const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // the page may have stopped being shared before we locked
+            std::uintptr_t value = e.load(std::memory_order_acquire);
+            if (value != shared_tag)
+            {
+                return resolve(value, a);
+            }
+            for (std::uintptr_t candidate : shared_.at(page))
+            {
+                if (memory_region* region = resolve(candidate, a))
+                {
+                    return region;
+                }
+            }
+            return nullptr;
+        }
+
+        using leaf_type = std::array<std::atomic<std::uintptr_t>, level_size>;
+        using mid_type = std::array<std::atomic<leaf_type*>, level_size>;
+        using root_type = std::array<std::atomic<mid_type*>, level_size>;
+
+        static inline std::size_t top_index(std::uintptr_t page)
+        {
+            return std::size_t(page >> (2 * level_bits)) & (level_size - 1);
+        }
+        static inline std::size_t mid_index(std::uintptr_t page)
+        {
+            return std::size_t(page >> level_bits) & (level_size - 1);
+        }
+        static inline std::size_t leaf_index(std::uintptr_t page)
+        {
+            return std::size_t(page) & (level_size - 1);
+        }
+
+        template <typename Node>
+        static Node* get_or_create(std::atomic<Node*>& slot)
+        {
+            Node* node = slot.load(std::memory_order_acquire);
+            if (node != nullptr)
+                return node;
+            Node* fresh = new Node();
+            for (auto& entry : *fresh)
+            {
+                entry.store(0, std::memory_order_relaxed);
+            }
+            // another thread may have installed the node first
+            if (!slot.compare_exchange_strong(node, fresh,
+                    std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                delete fresh;
+                return node;
+            }
+            return fresh;
+        }
+
+        std::atomic<std::uintptr_t>* entry(std::uintptr_t page, bool create)
+        {
+            std::atomic<mid_type*>& m = (*root_)[top_index(page)];
+            mid_type* mid = create ? get_or_create(m) : m.load(std::memory_order_acquire);
+            if (mid == nullptr)
+                return nullptr;
+            std::atomic<leaf_type*>& l = (*mid)[mid_index(page)];
+            leaf_type* leaf =
+                create ? get_or_create(l) : l.load(std::memory_order_acquire);
+            if (leaf == nullptr)
+                return nullptr;
+            return &(*leaf)[leaf_index(page)];
+        }
+
+        void set(const void* addr, std::size_t length, std::uintptr_t value)
+        {
+            std::uintptr_t a = reinterpret_cast<std::uintptr_t>(addr);
+            if (length == 0 || ((a + length - 1) >> address_bits) != 0)
+                return;
+            std::uintptr_t last = (a + length - 1) >> page_shift;
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::uintptr_t page = a >> page_shift; page <= last; ++page)
+            {
+                std::atomic<std::uintptr_t>* e = entry(page, true);
+                std::uintptr_t current = e->load(std::memory_order_relaxed);
+                if (current == 0)
+                {
+                    e->store(value, std::memory_order_release);
+                }
+                else if (current == shared_tag)
+                {
+                    shared_[page].push_back(value);
+                }
+                else
+                {
+                    // the candidates are visible before the tag
+                    shared_[page] = {current, value};
+                    e->store(shared_tag, std::memory_order_release);
+                }
+            }
+        }
+
+        void clear(const void* addr, std::size_t length, std::uintptr_t value)
+        {
+            std::uintptr_t a = reinterpret_cast<std::uintptr_t>(addr);
+            if (length == 0 || ((a + length - 1) >> address_bits) != 0)
+                return;
+            std::uintptr_t last = (a + length - 1) >> page_shift;
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::uintptr_t page = a >> page_shift; page <= last; ++page)
+            {
+                std::atomic<std::uintptr_t>* e = entry(page, false);
+                if (e == nullptr)
+                    continue;
+                std::uintptr_t current = e->load(std::memory_order_relaxed);
+                if (current == value)
+                {
+                    e->store(0, std::memory_order_release);
+                }
+                else if (current == shared_tag)
+                {
+                    auto it = shared_.find(page);
+                    std::vector<std::uintptr_t>& candidates = it->second;
+                    auto c = std::find(candidates.begin(), candidates.end(), value);
+                    if (c != candidates.end())
+                    {
+                        candidates.erase(c);
+                    }
+                    // a single remaining region owns the page again
+                    if (candidates.size() == 1)
+                    {
+                        e->store(candidates.front(), std::memory_order_release);
+                        shared_.erase(it);
+                    }
+                }
+            }
+        }
+
+        // 32KB, so it is allocated rather than embedded in the pool
+        root_type* root_;
+        // candidates of the pages tagged shared_tag, and the mutex that
+        // serializes insert/erase (and lookups of shared pages)
+        mutable std::mutex mutex_;
+        std::unordered_map<std::uintptr_t, std::vector<std::uintptr_t>> shared_;
+    };
+
+}}}    // namespace alloctools::rma::detail
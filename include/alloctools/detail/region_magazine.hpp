@@ -0,0 +1,206 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/memory_region.hpp>
+//
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // A magazine is a small bounded stack of regions that is owned by
+    // a single thread. Regions are popped/pushed from the magazine without
+    // any atomic operations and the magazine is refilled/flushed in batches
+    // from/to the shared free list of the memory_pool_stack that owns it.
+    // --------------------------------------------------------------------
+    template <std::size_t Capacity>
+    struct region_magazine
+    {
+        static_assert(Capacity >= 2, "A magazine must hold at least 2 regions");
+
+        region_magazine()
+          : id_(0)
+          , count_(0)
+        {
+        }
+
+        inline bool empty() const
+        {
+            return count_ == 0;
+        }
+
+        inline bool full() const
+        {
+            return count_ == Capacity;
+        }
+
+        inline memory_region* pop()
+        {
+            return regions_[--count_];
+        }
+
+        inline void push(memory_region* region)
+        {
+            regions_[count_++] = region;
+        }
+
+        static constexpr std::size_t capacity()
+        {
+            return Capacity;
+        }
+
+        // the number of regions moved to/from the shared stack in one batch
+        static constexpr std::size_t batch_size()
+        {
+            return Capacity / 2;
+        }
+
+        // unique id of the stack this magazine caches regions for,
+        // zero when the magazine is not bound to a stack
+        std::uint64_t id_;
+        std::size_t count_;
+        memory_region* regions_[Capacity];
+    };
+
+    // --------------------------------------------------------------------
+    // The registry hands out small dense slot indices to stacks using
+    // thread caching, so that a thread can find its magazine for a stack
+    // with a single vector index. Slots are recycled when a stack is
+    // destroyed, so every stack also gets a unique id that magazines
+    // compare against to detect stale contents.
+    // The registry mutex is only taken when stacks are created/destroyed
+    // and when a thread exits and flushes its magazines.
+    // --------------------------------------------------------------------
+    struct magazine_registry
+    {
+        // a stack registers a flush function so that exiting threads can
+        // return their cached regions without knowing the stack type
+        using flush_fn = void (*)(void* stack, memory_region** regions,
+            std::size_t count);
+
+        struct slot
+        {
+            std::uint64_t id_;
+            void* stack_;
+            flush_fn flush_;
+        };
+
+        static magazine_registry& instance()
+        {
+            static magazine_registry registry;
+            return registry;
+        }
+
+        std::uint32_t add(std::uint64_t id, void* stack, flush_fn fn)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::uint32_t index;
+            if (!free_slots_.empty())
+            {
+                index = free_slots_.back();
+                free_slots_.pop_back();
+                slots_[index] = slot{id, stack, fn};
+            }
+            else
+            {
+                index = static_cast<std::uint32_t>(slots_.size());
+                slots_.push_back(slot{id, stack, fn});
+            }
+            return index;
+        }
+
+        void remove(std::uint32_t index)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            slots_[index] = slot{0, nullptr, nullptr};
+            free_slots_.push_back(index);
+        }
+
+        // called at thread exit, return regions to the stack if it still exists
+        void flush(std::uint32_t index, std::uint64_t id,
+            memory_region** regions, std::size_t count)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (index < slots_.size() && slots_[index].id_ == id)
+            {
+                slots_[index].flush_(slots_[index].stack_, regions, count);
+            }
+        }
+
+        static std::uint64_t next_id()
+        {
+            static std::atomic<std::uint64_t> id{0};
+            return ++id;
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<slot> slots_;
+        std::vector<std::uint32_t> free_slots_;
+    };
+
+    // --------------------------------------------------------------------
+    // The set of magazines held by one thread, indexed by registry slot.
+    // On thread exit, any regions still held are flushed back to the
+    // shared free list of their stack.
+    // --------------------------------------------------------------------
+    template <std::size_t Capacity>
+    struct thread_magazines
+    {
+        using magazine_type = region_magazine<Capacity>;
+
+        ~thread_magazines()
+        {
+            for (std::size_t i = 0; i < magazines_.size(); ++i)
+            {
+                magazine_type& mag = magazines_[i];
+                if (mag.id_ != 0 && !mag.empty())
+                {
+                    magazine_registry::instance().flush(
+                        static_cast<std::uint32_t>(i), mag.id_, mag.regions_,
+                        mag.count_);
+                }
+            }
+        }
+
+        // get the magazine for a stack, discarding stale contents that
+        // belong to a previous (destroyed) stack that used the same slot
+        inline magazine_type& get(std::uint32_t slot, std::uint64_t id)
+        {
+            if (slot >= magazines_.size())
+            {
+                magazines_.resize(slot + 1);
+            }
+            magazine_type& mag = magazines_[slot];
+            if (mag.id_ != id)
+            {
+                mag.id_ = id;
+                mag.count_ = 0;
+            }
+            return mag;
+        }
+
+        static thread_magazines& local()
+        {
+            static thread_local thread_magazines magazines;
+            return magazines;
+        }
+
+    private:
+        std::vector<magazine_type> magazines_;
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -0,0 +1,176 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/config_defines.hpp>
+#include <alloctools/debugging/performance_counter.hpp>
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// the old (locking) debug set of the memory pool stacks is replaced by
+// the region tracker
+#if defined(RMA_POOL_DEBUG_SET) && !defined(ALLOCTOOLS_HAVE_REGION_TRACKING)
+#define ALLOCTOOLS_HAVE_REGION_TRACKING
+#endif
+
+// the return address of the calling function, recorded as the call site
+// of tracked regions
+#if defined(__GNUC__) || defined(__clang__)
+#define ALLOCTOOLS_CALL_SITE() __builtin_return_address(0)
+#else
+#define ALLOCTOOLS_CALL_SITE() nullptr
+#endif
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // a pool chunk that has been allocated and not yet returned. The call
+    // site is a return address (symbolize it with addr2line or dladdr),
+    // nullptr when it is not known
+    // --------------------------------------------------------------------
+    struct outstanding_region
+    {
+        void const* address;
+        std::size_t size;
+        std::int64_t age_ns;
+        void const* call_site;
+    };
+
+    // --------------------------------------------------------------------
+    // the outstanding chunks of a pool (or a stack), regions_ holds the
+    // oldest of them, oldest first
+    // --------------------------------------------------------------------
+    struct outstanding_report
+    {
+        std::size_t count = 0;
+        // chunks returned while they were not allocated (double frees),
+        // they are counted and reported but not pushed again
+        std::size_t double_frees = 0;
+        std::vector<outstanding_region> regions;
+
+        std::int64_t oldest_age_ns() const
+        {
+            return regions.empty() ? 0 : regions.front().age_ns;
+        }
+
+        // add the entries of another report, keeping the max_entries oldest
+        void merge(outstanding_report const& other, std::size_t max_entries)
+        {
+            count += other.count;
+            double_frees += other.double_frees;
+            regions.insert(
+                regions.end(), other.regions.begin(), other.regions.end());
+            keep_oldest(max_entries);
+        }
+
+        void keep_oldest(std::size_t max_entries)
+        {
+            auto older = [](outstanding_region const& a,
+                             outstanding_region const& b) {
+                return a.age_ns > b.age_ns;
+            };
+            if (regions.size() > max_entries)
+            {
+                std::nth_element(regions.begin(),
+                    regions.begin() + std::ptrdiff_t(max_entries), regions.end(),
+                    older);
+                regions.resize(max_entries);
+            }
+            std::sort(regions.begin(), regions.end(), older);
+        }
+    };
+
+}}    // namespace alloctools::rma
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // the tracking state of one pool chunk, kept beside its descriptor.
+    // since_ is the time (steady clock ns) the chunk was allocated and
+    // 0 while it is free
+    // --------------------------------------------------------------------
+    struct region_track_record
+    {
+        std::atomic<std::int64_t> since_{0};
+        std::atomic<void const*> site_{nullptr};
+    };
+
+    // --------------------------------------------------------------------
+    // Counts the chunks of one stack that are allocated. Allocations and
+    // releases are counted in per thread shards and the state of a chunk
+    // is set with one atomic store (one exchange on release, which is how
+    // double frees are detected), so tracking takes no locks and does not
+    // serialize threads. Outstanding chunks are found by scanning the
+    // records of the slabs, which is only done when a report is requested.
+    // --------------------------------------------------------------------
+    struct region_tracker
+    {
+        region_tracker()
+          : allocated_(0)
+          , released_(0)
+          , double_frees_(0)
+        {
+        }
+
+        static inline std::int64_t now_ns()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+        }
+
+        inline void allocated(region_track_record& record)
+        {
+            record.site_.store(nullptr, std::memory_order_relaxed);
+            // never 0, that marks a free chunk
+            record.since_.store(
+                (std::max)(now_ns(), std::int64_t(1)), std::memory_order_relaxed);
+            ++allocated_;
+        }
+
+        // returns false if the chunk was not allocated
+        inline bool released(region_track_record& record)
+        {
+            if (record.since_.exchange(0, std::memory_order_relaxed) == 0)
+            {
+                double_frees_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            ++released_;
+            return true;
+        }
+
+        // releases are read first, so that a chunk allocated and released
+        // while reading cannot make the count negative
+        std::size_t outstanding() const
+        {
+            std::size_t released = released_;
+            std::size_t allocated = allocated_;
+            return allocated - (std::min)(released, allocated);
+        }
+
+        std::size_t double_frees() const
+        {
+            return double_frees_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        debug::sharded_counter<std::size_t, true> allocated_;
+        debug::sharded_counter<std::size_t, true> released_;
+        std::atomic<std::size_t> double_frees_;
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -0,0 +1,387 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+#include <alloctools/detail/memory_region_impl.hpp>
+#include <alloctools/detail/page_map.hpp>
+//
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> rcache_deb("RCACHE ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // A cache of registrations of user memory, so that sending repeatedly
+    // from the same buffers does not pin and unpin the pages every time.
+    //
+    // Registrations are rounded out to whole pages and kept in an interval
+    // map of non overlapping address ranges. A request that is covered by
+    // an existing entry returns a view of that registration, a request that
+    // overlaps entries registers the union of them and replaces them.
+    // Views are reference counted, entries that are not referenced are kept
+    // on an LRU list and evicted (deregistered) when the cache holds more
+    // than max_bytes or max_entries.
+    //
+    // The cache cannot see when memory is freed or unmapped (there is no
+    // munmap hook), so the contract is: memory that was passed to acquire
+    // must be invalidated with invalidate(ptr, length) before it is freed,
+    // unmapped or otherwise returned to the system, otherwise a later
+    // acquire of a reused address range may return a stale registration.
+    // Entries that are invalidated (or cleared) while referenced stay
+    // registered, and are counted in registered_bytes, until their last
+    // view is released.
+    //
+    // With a page map attached, the registration of each indexed entry is
+    // inserted once (not every view), so an address in cached memory
+    // resolves to the registration covering it.
+    //
+    // The cache is owned through a shared_ptr, each referenced entry keeps
+    // the cache alive so that views may be released after the owner has
+    // cleared and dropped it.
+    // --------------------------------------------------------------------
+    template <typename RegionProvider>
+    struct registration_cache
+      : std::enable_shared_from_this<registration_cache<RegionProvider>>
+    {
+        using domain_type = typename RegionProvider::provider_domain;
+        using region_type_impl = memory_region_impl<RegionProvider>;
+
+        // ------------------------------------------------------------------
+        // one registration of a page aligned range [start_, end_)
+        struct entry
+        {
+            std::uintptr_t start_;
+            std::uintptr_t end_;
+            std::unique_ptr<region_type_impl> region_;
+            std::size_t refs_;
+            // the cache, held while refs_ > 0
+            std::shared_ptr<registration_cache> owner_;
+            // false once the entry has been removed from the interval map
+            bool indexed_;
+            // position on the LRU list, valid when refs_ == 0 && indexed_
+            typename std::list<entry*>::iterator lru_;
+        };
+
+        // ------------------------------------------------------------------
+        // what the user gets, a partial region inside a cached registration
+        struct view : region_type_impl
+        {
+            view(entry* e, const void* ptr, std::size_t length)
+              : region_type_impl(*e->region_,
+                    static_cast<char*>(const_cast<void*>(ptr)), length,
+                    memory_region::BLOCK_PARTIAL | memory_region::BLOCK_CACHED)
+              , entry_(e)
+            {
+            }
+            entry* entry_;
+        };
+
+        // ------------------------------------------------------------------
+        registration_cache(domain_type* pd, std::size_t max_bytes,
+            std::size_t max_entries)
+          : pd_(pd)
+          , page_map_(nullptr)
+          , max_bytes_(max_bytes)
+          , max_entries_((std::max)(max_entries, std::size_t(1)))
+          , page_size_(std::size_t(sysconf(_SC_PAGESIZE)))
+          , bytes_(0)
+          , entries_(0)
+          , hits_(0)
+          , misses_(0)
+          , evictions_(0)
+        {
+        }
+
+        ~registration_cache()
+        {
+            clear();
+        }
+
+        registration_cache(registration_cache const&) = delete;
+        registration_cache& operator=(registration_cache const&) = delete;
+
+        // ------------------------------------------------------------------
+        // add the registrations of (current and future) entries to an
+        // address map, nullptr removes them from the current map
+        void set_page_map(page_map* map)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& item : index_)
+            {
+                if (page_map_ != nullptr)
+                    page_map_->erase(item.second->region_.get());
+                if (map != nullptr)
+                    map->insert(item.second->region_.get());
+            }
+            page_map_ = map;
+        }
+
+        // ------------------------------------------------------------------
+        // return a region for [ptr, ptr+length) backed by a cached
+        // registration, registering the memory if necessary
+        memory_region* acquire(const void* ptr, std::size_t length)
+        {
+            std::uintptr_t start = reinterpret_cast<std::uintptr_t>(ptr);
+            std::uintptr_t end = start + (std::max)(length, std::size_t(1));
+            std::lock_guard<std::mutex> lock(mutex_);
+            entry* e = find_covering(start, end);
+            if (e != nullptr)
+            {
+                ++hits_;
+                GHEX_DP_ONLY(rcache_deb,
+                    trace(alloctools::debug::str<>("hit"), alloctools::debug::ptr(ptr),
+                        alloctools::debug::hex<6>(length)));
+                if (e->refs_ == 0)
+                {
+                    lru_.erase(e->lru_);
+                }
+            }
+            else
+            {
+                ++misses_;
+                e = insert(start, end);
+            }
+            if (e->refs_++ == 0)
+            {
+                e->owner_ = this->shared_from_this();
+            }
+            return new view(e, ptr, length);
+        }
+
+        // ------------------------------------------------------------------
+        // release a view returned by acquire, the cache is found through the
+        // view so this is valid after the owner of the cache has dropped it
+        static void release(memory_region* region)
+        {
+            entry* e = static_cast<view*>(region)->entry_;
+            delete region;
+            // the caller holds a reference, so owner_ is set and stable
+            registration_cache* self = e->owner_.get();
+            // dropped after the mutex is unlocked, may delete the cache
+            std::shared_ptr<registration_cache> owner;
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            if (--e->refs_ == 0)
+            {
+                owner = std::move(e->owner_);
+                if (e->indexed_)
+                {
+                    e->lru_ = self->lru_.insert(self->lru_.end(), e);
+                    self->evict();
+                }
+                else
+                {
+                    self->destroy(e);
+                }
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // drop every registration that overlaps [ptr, ptr+length), this must
+        // be called before such memory is freed or unmapped (see above)
+        void invalidate(const void* ptr, std::size_t length)
+        {
+            std::uintptr_t start = reinterpret_cast<std::uintptr_t>(ptr);
+            std::uintptr_t end = start + (std::max)(length, std::size_t(1));
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (entry* e : overlapping(start, end))
+            {
+                GHEX_DP_ONLY(rcache_deb,
+                    debug(alloctools::debug::str<>("invalidate"),
+                        alloctools::debug::hex<12>(e->start_),
+                        alloctools::debug::hex<12>(e->end_)));
+                retire(e);
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // deregister all unreferenced entries, referenced ones are retired
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<entry*> all;
+            for (auto& item : index_)
+            {
+                all.push_back(item.second);
+            }
+            for (entry* e : all)
+            {
+                retire(e);
+            }
+        }
+
+        // ------------------------------------------------------------------
+        std::size_t registered_bytes() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return bytes_;
+        }
+
+        std::size_t entries() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return entries_;
+        }
+
+        std::size_t hits() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return hits_;
+        }
+
+        std::size_t misses() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return misses_;
+        }
+
+        std::size_t evictions() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return evictions_;
+        }
+
+    private:
+        // ------------------------------------------------------------------
+        // entries in the map never overlap, so the only candidate is the
+        // last one starting at or before start
+        entry* find_covering(std::uintptr_t start, std::uintptr_t end) const
+        {
+            auto it = index_.upper_bound(start);
+            if (it == index_.begin())
+                return nullptr;
+            --it;
+            return (it->second->end_ >= end) ? it->second : nullptr;
+        }
+
+        std::vector<entry*> overlapping(std::uintptr_t start, std::uintptr_t end) const
+        {
+            std::vector<entry*> result;
+            auto it = index_.upper_bound(start);
+            if (it != index_.begin())
+            {
+                auto prev = std::prev(it);
+                if (prev->second->end_ > start)
+                    result.push_back(prev->second);
+            }
+            for (; it != index_.end() && it->first < end; ++it)
+            {
+                result.push_back(it->second);
+            }
+            return result;
+        }
+
+        // ------------------------------------------------------------------
+        // register the page aligned union of the request and every entry
+        // it overlaps, the overlapped entries are retired
+        entry* insert(std::uintptr_t start, std::uintptr_t end)
+        {
+            start &= ~std::uintptr_t(page_size_ - 1);
+            end = (end + page_size_ - 1) & ~std::uintptr_t(page_size_ - 1);
+            for (entry* e : overlapping(start, end))
+            {
+                start = (std::min)(start, e->start_);
+                end = (std::max)(end, e->end_);
+                retire(e);
+            }
+            entry* e = new entry();
+            e->start_ = start;
+            e->end_ = end;
+            e->refs_ = 0;
+            e->indexed_ = true;
+            e->region_.reset(new region_type_impl(
+                pd_, reinterpret_cast<const void*>(start), end - start));
+            index_.emplace(start, e);
+            if (page_map_ != nullptr)
+            {
+                page_map_->insert(e->region_.get());
+            }
+            bytes_ += end - start;
+            ++entries_;
+            GHEX_DP_ONLY(rcache_deb,
+                debug(alloctools::debug::str<>("register"),
+                    alloctools::debug::hex<12>(start), alloctools::debug::hex<12>(end),
+                    "entries", alloctools::debug::dec<>(entries_)));
+            // the new entry is not on the LRU list (the caller references
+            // it straight away) so it is never evicted here
+            evict();
+            return e;
+        }
+
+        // ------------------------------------------------------------------
+        // evict least recently used entries until the cache is within limits
+        void evict()
+        {
+            while ((bytes_ > max_bytes_ || entries_ > max_entries_) &&
+                !lru_.empty())
+            {
+                ++evictions_;
+                retire(lru_.front());
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // remove an entry from the map (and the page map, its memory may be
+        // about to be freed), it is destroyed now if nobody references it,
+        // otherwise when its last view is released
+        void retire(entry* e)
+        {
+            index_.erase(e->start_);
+            e->indexed_ = false;
+            if (page_map_ != nullptr)
+            {
+                page_map_->erase(e->region_.get());
+            }
+            if (e->refs_ == 0)
+            {
+                lru_.erase(e->lru_);
+                destroy(e);
+            }
+        }
+
+        // the memory stays pinned until here, so it is counted until here
+        void destroy(entry* e)
+        {
+            bytes_ -= e->end_ - e->start_;
+            --entries_;
+            // unregisters the memory, the user region owns no storage
+            delete e;
+        }
+
+        domain_type* pd_;
+        page_map* page_map_;
+        std::size_t max_bytes_;
+        std::size_t max_entries_;
+        std::size_t page_size_;
+        mutable std::mutex mutex_;
+        std::map<std::uintptr_t, entry*> index_;
+        std::list<entry*> lru_;
+        std::size_t bytes_;
+        std::size_t entries_;
+        std::size_t hits_;
+        std::size_t misses_;
+        std::size_t evictions_;
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -0,0 +1,217 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/config_defines.hpp>
+#include <alloctools/detail/backing_store.hpp>
+//
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// the chunk size of the smallest size class in bytes
+#ifndef ALLOCTOOLS_TINY_MEMORY_CHUNK_SIZE
+#define ALLOCTOOLS_TINY_MEMORY_CHUNK_SIZE 0x1000    // 4KB, as the cmake default
+#endif
+
+// the memory reserved for each size class at startup, in units of 64KB pages
+#ifndef ALLOCTOOLS_64K_PAGES
+#define ALLOCTOOLS_64K_PAGES 10
+#endif
+
+// the default chunk size of the largest size class in bytes
+#define RDMA_POOL_MAX_CHUNK_SIZE 0x400 * 0x0400    //  1MB
+
+// the default minimum number of chunks reserved for each size class
+#define RDMA_POOL_MIN_CHUNKS 4
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // Describes the geometric sequence of size classes a memory pool uses,
+    // and the optional features of the pool
+    // --------------------------------------------------------------------
+    struct size_class_config
+    {
+        // classes are powers of two from min_chunk_size to max_chunk_size
+        // (inclusive)
+        std::size_t min_chunk_size = ALLOCTOOLS_TINY_MEMORY_CHUNK_SIZE;
+        std::size_t max_chunk_size = RDMA_POOL_MAX_CHUNK_SIZE;
+
+        // memory reserved by each class at startup (per NUMA node when
+        // numa_aware), but never less than min_chunks chunks (at least 1)
+        std::size_t initial_bytes = ALLOCTOOLS_64K_PAGES * 0x10000;
+        std::size_t min_chunks = RDMA_POOL_MIN_CHUNKS;
+
+        // percentages of the initial number of chunks, a class below the
+        // low watermark is grown back up to the high one
+        std::size_t low_watermark_percent = 25;
+        std::size_t high_watermark_percent = 100;
+
+        // grow classes on a worker thread rather than the allocating one
+        bool background_refill = false;
+
+        // non zero: the worker releases slabs that have been completely
+        // free for longer than this
+        std::chrono::milliseconds slab_idle_timeout{0};
+
+        // one set of classes per NUMA node (when there is more than one),
+        // backed by memory bound to that node
+        bool numa_aware = false;
+
+        // the pages slabs are allocated from, huge pages are only used for
+        // slabs of at least one huge page and fall back to smaller pages
+        page_policy slab_pages = page_policy::heap;
+
+        // non zero: cache the registrations of register_temporary_region,
+        // bounded by bytes and entries. Callers must then invalidate memory
+        // before freeing it (see memory_pool::invalidate_registrations)
+        std::size_t registration_cache_bytes = 0;
+        std::size_t registration_cache_entries = 1024;
+
+        // objects of up to small_object_max_size bytes (a power of two from
+        // 16 to 4096, 0 disables this) from allocate_small are packed into
+        // registered pages taken from slabs of small_object_slab_bytes
+        std::size_t small_object_max_size = 512;
+        std::size_t small_object_slab_bytes = 0x10000;
+
+        // non zero: an arena of this size (rounded up to a power of two)
+        // serves requests larger than the largest class with a buddy
+        // allocator, they are registered on the fly only when it is full
+        std::size_t large_arena_bytes = 0;
+    };
+
+}}    // namespace alloctools::rma
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // return the number of bits needed to represent x, (floor(log2(x))+1)
+    // --------------------------------------------------------------------
+    inline unsigned int bit_width(std::uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return x == 0 ? 0 : 64 - __builtin_clzll(x);
+#else
+        unsigned int n = 0;
+        while (x != 0)
+        {
+            x >>= 1;
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    inline bool is_power_of_two(std::uint64_t x)
+    {
+        return x != 0 && (x & (x - 1)) == 0;
+    }
+
+    // --------------------------------------------------------------------
+    // The size class table maps a requested length to the index of the
+    // smallest class that can hold it using a count-leading-zeros, there are
+    // no branches or loops over the classes.
+    // Lengths larger than the biggest class return an index >= size().
+    // --------------------------------------------------------------------
+    struct size_class_table
+    {
+        size_class_table(size_class_config const& config)
+        {
+            if (!is_power_of_two(config.min_chunk_size) ||
+                !is_power_of_two(config.max_chunk_size) ||
+                config.min_chunk_size < 2 ||
+                config.max_chunk_size < config.min_chunk_size)
+            {
+                throw std::invalid_argument(
+                    "size class chunk sizes must be powers of two with min <= max");
+            }
+            if (config.min_chunks == 0)
+            {
+                throw std::invalid_argument(
+                    "min_chunks must be at least 1 so that every class has a slab");
+            }
+            if (config.small_object_max_size != 0 &&
+                (!is_power_of_two(config.small_object_max_size) ||
+                    config.small_object_max_size < 16 ||
+                    config.small_object_max_size > 4096))
+            {
+                throw std::invalid_argument(
+                    "small_object_max_size must be a power of two from 16 to 4096");
+            }
+            min_shift_ = bit_width(config.min_chunk_size) - 1;
+            min_mask_ = config.min_chunk_size - 1;
+            for (std::size_t size = config.min_chunk_size;
+                 size <= config.max_chunk_size; size <<= 1)
+            {
+                chunk_sizes_.push_back(size);
+                std::size_t n = (std::max)(
+                    config.initial_bytes / size, config.min_chunks);
+                num_chunks_.push_back(n);
+                low_watermarks_.push_back(n * config.low_watermark_percent / 100);
+                high_watermarks_.push_back(
+                    n * config.high_watermark_percent / 100);
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // index of the smallest class with chunk_size >= length,
+        // a length of 0 returns the smallest class
+        inline std::size_t index(std::size_t length) const
+        {
+            // length-1 without underflow, clamped up to the smallest class
+            std::uint64_t l = (length - (length != 0)) | min_mask_;
+            return bit_width(l) - min_shift_;
+        }
+
+        inline std::size_t size() const
+        {
+            return chunk_sizes_.size();
+        }
+
+        inline std::size_t chunk_size(std::size_t index) const
+        {
+            return chunk_sizes_[index];
+        }
+
+        inline std::size_t num_chunks(std::size_t index) const
+        {
+            return num_chunks_[index];
+        }
+
+        inline std::size_t low_watermark(std::size_t index) const
+        {
+            return low_watermarks_[index];
+        }
+
+        inline std::size_t high_watermark(std::size_t index) const
+        {
+            return high_watermarks_[index];
+        }
+
+        inline std::size_t max_chunk_size() const
+        {
+            return chunk_sizes_.back();
+        }
+
+    private:
+        unsigned int min_shift_;
+        std::uint64_t min_mask_;
+        std::vector<std::size_t> chunk_sizes_;
+        std::vector<std::size_t> num_chunks_;
+        std::vector<std::size_t> low_watermarks_;
+        std::vector<std::size_t> high_watermarks_;
+    };
+
+}}}    // namespace alloctools::rma::detail
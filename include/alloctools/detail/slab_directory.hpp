@@ -0,0 +1,201 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // A directory of slabs (the large registered blocks that a memory pool
+    // stack is carved from) with lock-free lookup and iteration.
+    // Entries are stored in fixed size segments that are allocated on
+    // demand and never moved, so readers may iterate over the directory
+    // while other threads append to it. An entry becomes visible once
+    // its pointer has been published, readers skip unpublished slots.
+    // A removed slab leaves an empty slot that the next append reuses
+    // (the free slots are kept under a mutex, appends are rare).
+    // The directory owns the slabs and deletes them on clear/destruction,
+    // which must not run concurrently with append or iteration. A removed
+    // slab is handed back to the caller and no longer owned.
+    // --------------------------------------------------------------------
+    template <typename Slab, std::size_t SegmentSize = 64,
+        std::size_t MaxSegments = 1024>
+    struct slab_directory
+    {
+        slab_directory()
+          : count_(0)
+        {
+            for (auto& segment : segments_)
+            {
+                segment.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~slab_directory()
+        {
+            clear();
+        }
+
+        slab_directory(slab_directory const&) = delete;
+        slab_directory& operator=(slab_directory const&) = delete;
+
+        // ------------------------------------------------------------------
+        // add a slab and return its index, safe to call from any thread
+        std::size_t append(Slab* slab)
+        {
+            {
+                std::lock_guard<std::mutex> lock(free_slots_mutex_);
+                if (!free_slots_.empty())
+                {
+                    std::size_t index = free_slots_.back();
+                    free_slots_.pop_back();
+                    slot(index).store(slab, std::memory_order_release);
+                    return index;
+                }
+            }
+            std::size_t index = count_.fetch_add(1, std::memory_order_relaxed);
+            std::size_t seg = index / SegmentSize;
+            if (seg >= MaxSegments)
+            {
+                count_.fetch_sub(1, std::memory_order_relaxed);
+                throw std::runtime_error("slab directory is full");
+            }
+            segment_type* segment = get_or_create_segment(seg);
+            (*segment)[index % SegmentSize].store(
+                slab, std::memory_order_release);
+            return index;
+        }
+
+        // ------------------------------------------------------------------
+        // return the slab at index, or nullptr if it is not yet published
+        Slab* get(std::size_t index) const
+        {
+            segment_type* segment =
+                segments_[index / SegmentSize].load(std::memory_order_acquire);
+            if (segment == nullptr)
+                return nullptr;
+            return (*segment)[index % SegmentSize].load(
+                std::memory_order_acquire);
+        }
+
+        // ------------------------------------------------------------------
+        // the slab at index when the caller knows it is published (it holds
+        // a region of the slab), a missing slab means the directory and its
+        // regions disagree, which is not recoverable
+        Slab& published(std::size_t index) const
+        {
+            Slab* slab = get(index);
+            if (slab == nullptr)
+            {
+                std::abort();
+            }
+            return *slab;
+        }
+
+        // ------------------------------------------------------------------
+        // empty the slot at index (so that it can be reused) and return the
+        // slab that was stored in it, readers that already hold the pointer
+        // may still use it, the caller decides when it can be deleted
+        Slab* remove(std::size_t index)
+        {
+            Slab* slab = slot(index).exchange(nullptr, std::memory_order_acq_rel);
+            std::lock_guard<std::mutex> lock(free_slots_mutex_);
+            free_slots_.push_back(index);
+            return slab;
+        }
+
+        // ------------------------------------------------------------------
+        // the number of slots reserved so far (some may be unpublished)
+        std::size_t size() const
+        {
+            return count_.load(std::memory_order_acquire);
+        }
+
+        // ------------------------------------------------------------------
+        // call f(slab) for every published slab
+        template <typename F>
+        void for_each(F&& f) const
+        {
+            const std::size_t n = size();
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                if (Slab* slab = get(i))
+                {
+                    f(slab);
+                }
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // delete all slabs and segments, not thread safe
+        void clear()
+        {
+            for (auto& s : segments_)
+            {
+                segment_type* segment = s.load(std::memory_order_acquire);
+                if (segment == nullptr)
+                    continue;
+                for (auto& entry : *segment)
+                {
+                    delete entry.load(std::memory_order_relaxed);
+                }
+                delete segment;
+                s.store(nullptr, std::memory_order_relaxed);
+            }
+            count_.store(0, std::memory_order_release);
+            free_slots_.clear();
+        }
+
+    private:
+        using segment_type = std::array<std::atomic<Slab*>, SegmentSize>;
+
+        // a slot that has been reserved (its segment exists)
+        std::atomic<Slab*>& slot(std::size_t index)
+        {
+            return (*segments_[index / SegmentSize].load(
+                std::memory_order_acquire))[index % SegmentSize];
+        }
+
+        segment_type* get_or_create_segment(std::size_t seg)
+        {
+            segment_type* segment =
+                segments_[seg].load(std::memory_order_acquire);
+            if (segment != nullptr)
+                return segment;
+            segment_type* fresh = new segment_type();
+            for (auto& entry : *fresh)
+            {
+                entry.store(nullptr, std::memory_order_relaxed);
+            }
+            // another thread may have installed the segment first
+            if (!segments_[seg].compare_exchange_strong(segment, fresh,
+                    std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                delete fresh;
+                return segment;
+            }
+            return fresh;
+        }
+
+        std::atomic<std::size_t> count_;
+        std::array<std::atomic<segment_type*>, MaxSegments> segments_;
+        std::mutex free_slots_mutex_;
+        std::vector<std::size_t> free_slots_;
+    };
+
+}}}    // namespace alloctools::rma::detail
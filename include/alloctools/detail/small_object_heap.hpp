@@ -0,0 +1,403 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+#include <alloctools/detail/backing_store.hpp>
+#include <alloctools/detail/memory_block_allocator.hpp>
+#include <alloctools/detail/memory_region_impl.hpp>
+#include <alloctools/detail/page_map.hpp>
+#include <alloctools/detail/size_class_table.hpp>
+#include <alloctools/memory_region.hpp>
+//
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> small_deb("SMALL  ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma { namespace detail {
+
+    // --------------------------------------------------------------------
+    // return the index of the lowest set bit of a non zero word
+    // --------------------------------------------------------------------
+    inline unsigned int lowest_bit(std::uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return unsigned(__builtin_ctzll(x));
+#else
+        unsigned int n = 0;
+        while ((x & 1) == 0)
+        {
+            x >>= 1;
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    // --------------------------------------------------------------------
+    // A heap for objects of 16 to 512 bytes carved out of registered pages.
+    //
+    // Registered slabs are split into 4K pages, a page holds objects of a
+    // single size class (16, 32, ... max_object_size) and a bitmap of the
+    // free objects. The bitmap and the region descriptor of each page are
+    // kept outside the page, so all of the pinned memory holds objects.
+    // The descriptor is a partial region of the slab that carries the keys
+    // of the slab registration and is handed out with every object of the
+    // page (address + region, like a memory_region_pointer).
+    //
+    // Each class keeps a (doubly linked) list of pages with free objects
+    // under its own mutex, allocation scans the bitmap a 64 bit word at a
+    // time (count trailing zeros). Pages that become completely free go
+    // back to a shared list and can be reused by any class. Slabs are only
+    // released when the heap is destroyed.
+    //
+    // Slabs are entered into the page map of the pool, an object is freed
+    // by address and region_from_address finds the region of its page.
+    // --------------------------------------------------------------------
+    template <typename RegionProvider>
+    struct small_object_heap
+    {
+        using domain_type = typename RegionProvider::provider_domain;
+        using region_type = memory_region;
+        using region_type_impl = memory_region_impl<RegionProvider>;
+        using allocator_type = memory_block_allocator<RegionProvider>;
+        using block_ptr = typename allocator_type::region_ptr;
+
+        static constexpr std::size_t page_size = 4096;
+        static constexpr std::size_t min_object_size = 16;
+        static constexpr unsigned int min_object_shift = 4;
+        static constexpr std::size_t bitmap_words = page_size / min_object_size / 64;
+
+        // ------------------------------------------------------------------
+        // the out of line header of one page, region_ must be first so that
+        // the page map can return it as a memory_region
+        struct page
+        {
+            region_type_impl region_;
+            std::array<std::uint64_t, bitmap_words> free_bits_;
+            // links of the partial list of the class (next_ alone on the
+            // list of free pages)
+            page* next_;
+            page* prev_;
+            std::uint32_t free_objects_;
+            std::uint32_t size_class_;
+
+            page(region_type_impl const& block, char* address)
+              : region_(block, address, page_size,
+                    region_type::BLOCK_PARTIAL | region_type::BLOCK_SMALL)
+              , next_(nullptr)
+              , prev_(nullptr)
+              , free_objects_(0)
+              , size_class_(0)
+            {
+            }
+        };
+
+        // ------------------------------------------------------------------
+        // one registered block and the headers of its pages
+        struct slab
+        {
+            block_ptr block_;
+            char* storage_;
+            page* pages_;
+            std::size_t num_pages_;
+            slab_span span_;
+
+            ~slab()
+            {
+                for (std::size_t i = 0; i < num_pages_; ++i)
+                {
+                    pages_[i].~page();
+                }
+                delete[] storage_;
+            }
+        };
+
+        // ------------------------------------------------------------------
+        // pages of one size class with at least one free object
+        struct alignas(64) size_class
+        {
+            std::mutex mutex_;
+            page* partial_;
+        };
+
+        // ------------------------------------------------------------------
+        // max_object_size must be a power of two between 16 and 4096
+        small_object_heap(domain_type* pd, std::size_t max_object_size,
+            std::size_t slab_bytes, int numa_node, page_policy policy)
+          : pd_(pd)
+          , num_classes_(bit_width(max_object_size - 1) - min_object_shift + 1)
+          , slab_bytes_((std::max)(slab_bytes, page_size))
+          , numa_node_(numa_node)
+          , page_policy_(policy == page_policy::heap ? page_policy::pages : policy)
+          , page_map_(nullptr)
+          , classes_(new size_class[num_classes_])
+          , free_pages_(nullptr)
+          , num_slabs_(0)
+        {
+            for (std::size_t i = 0; i < num_classes_; ++i)
+            {
+                classes_[i].partial_ = nullptr;
+            }
+        }
+
+        ~small_object_heap()
+        {
+            for (auto& s : slabs_)
+            {
+                if (page_map_ != nullptr)
+                {
+                    page_map_->erase(&s->span_);
+                }
+            }
+        }
+
+        small_object_heap(small_object_heap const&) = delete;
+        small_object_heap& operator=(small_object_heap const&) = delete;
+
+        void set_page_map(page_map* map)
+        {
+            page_map_ = map;
+        }
+
+        // ------------------------------------------------------------------
+        // the largest object size the heap serves
+        std::size_t max_object_size() const
+        {
+            return min_object_size << (num_classes_ - 1);
+        }
+
+        // ------------------------------------------------------------------
+        // returns the address of a free object of at least length bytes,
+        // region is set to the descriptor of its page
+        void* allocate(std::size_t length, region_type*& region)
+        {
+            std::uint32_t cls = class_index(length);
+            size_class& sc = classes_[cls];
+            std::lock_guard<std::mutex> lock(sc.mutex_);
+            page* p = sc.partial_;
+            if (p == nullptr)
+            {
+                p = new_page(cls);
+                link(sc, p);
+            }
+            std::size_t word = 0;
+            while (p->free_bits_[word] == 0)
+            {
+                ++word;
+            }
+            unsigned int bit = lowest_bit(p->free_bits_[word]);
+            p->free_bits_[word] &= p->free_bits_[word] - 1;
+            if (--p->free_objects_ == 0)
+            {
+                unlink(sc, p);
+            }
+            region = &p->region_;
+            void* address = p->region_.get_address() +
+                ((word * 64 + bit) << (min_object_shift + cls));
+            GHEX_DP_ONLY(small_deb,
+                trace(alloctools::debug::str<>("allocate"),
+                    alloctools::debug::ptr(address),
+                    alloctools::debug::dec<>(min_object_size << cls)));
+            return address;
+        }
+
+        // ------------------------------------------------------------------
+        // return an object, region is the page descriptor given by allocate
+        void deallocate(void* address, region_type* region)
+        {
+            page* p = reinterpret_cast<page*>(static_cast<region_type_impl*>(region));
+            std::uint32_t cls = p->size_class_;
+            std::size_t index = std::size_t(static_cast<char*>(address) -
+                                    p->region_.get_address()) >>
+                (min_object_shift + cls);
+            size_class& sc = classes_[cls];
+            std::unique_lock<std::mutex> lock(sc.mutex_);
+            p->free_bits_[index / 64] |= std::uint64_t(1) << (index % 64);
+            std::uint32_t free_objects = ++p->free_objects_;
+            // a page is on the partial list if it had a free object before
+            bool listed = free_objects != 1;
+            if (free_objects == objects_per_page(cls))
+            {
+                // completely free (with one object per page the page was
+                // also full), the only page of the class is kept
+                if (!listed && sc.partial_ == nullptr)
+                {
+                    link(sc, p);
+                    return;
+                }
+                if (listed)
+                {
+                    if (sc.partial_ == p && p->next_ == nullptr)
+                    {
+                        return;
+                    }
+                    unlink(sc, p);
+                }
+                lock.unlock();
+                std::lock_guard<std::mutex> pages_lock(pages_mutex_);
+                p->next_ = free_pages_;
+                free_pages_ = p;
+            }
+            else if (!listed)
+            {
+                // the page was full, make it available again
+                link(sc, p);
+            }
+        }
+
+        // ------------------------------------------------------------------
+        // lock free, so that statistics can be read while allocating
+        std::size_t registered_bytes() const
+        {
+            return num_slabs_.load(std::memory_order_relaxed) * slab_bytes_;
+        }
+
+    private:
+        // ------------------------------------------------------------------
+        inline std::uint32_t class_index(std::size_t length) const
+        {
+            std::uint64_t l = (length - (length != 0)) | (min_object_size - 1);
+            return std::uint32_t(bit_width(l) - min_object_shift);
+        }
+
+        static inline std::uint32_t objects_per_page(std::uint32_t cls)
+        {
+            return std::uint32_t(page_size >> (min_object_shift + cls));
+        }
+
+        // ------------------------------------------------------------------
+        // add/remove a page to/from the partial list of a class
+        static void link(size_class& sc, page* p)
+        {
+            p->prev_ = nullptr;
+            p->next_ = sc.partial_;
+            if (sc.partial_ != nullptr)
+            {
+                sc.partial_->prev_ = p;
+            }
+            sc.partial_ = p;
+        }
+
+        static void unlink(size_class& sc, page* p)
+        {
+            if (p->prev_ != nullptr)
+            {
+                p->prev_->next_ = p->next_;
+            }
+            else
+            {
+                sc.partial_ = p->next_;
+            }
+            if (p->next_ != nullptr)
+            {
+                p->next_->prev_ = p->prev_;
+            }
+            p->next_ = nullptr;
+            p->prev_ = nullptr;
+        }
+
+        // ------------------------------------------------------------------
+        // a free page formatted for a size class, the caller holds the lock
+        // of the class
+        page* new_page(std::uint32_t cls)
+        {
+            page* p = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(pages_mutex_);
+                if (free_pages_ == nullptr)
+                {
+                    allocate_slab();
+                }
+                p = free_pages_;
+                free_pages_ = p->next_;
+            }
+            std::uint32_t n = objects_per_page(cls);
+            for (std::size_t w = 0; w < bitmap_words; ++w)
+            {
+                std::size_t bits = (n > w * 64) ? (std::min)(n - w * 64, std::size_t(64)) : 0;
+                p->free_bits_[w] = (bits == 64) ? ~std::uint64_t(0) :
+                                                  (std::uint64_t(1) << bits) - 1;
+            }
+            p->free_objects_ = n;
+            p->size_class_ = cls;
+            p->next_ = nullptr;
+            p->prev_ = nullptr;
+            return p;
+        }
+
+        // ------------------------------------------------------------------
+        // register a new slab and put its pages on the free list,
+        // the caller holds pages_mutex_
+        void allocate_slab()
+        {
+            std::unique_ptr<slab> s(new slab());
+            s->block_ = allocator_type::malloc(pd_, slab_bytes_, numa_node_, page_policy_);
+            // pages must be page aligned (the block is not when it came from
+            // the heap, the partial page at the start is then unused)
+            std::uintptr_t base =
+                reinterpret_cast<std::uintptr_t>(s->block_->get_address());
+            std::uintptr_t first = (base + page_size - 1) & ~std::uintptr_t(page_size - 1);
+            s->num_pages_ = (base + s->block_->get_size() - first) / page_size;
+            s->storage_ = new char[s->num_pages_ * sizeof(page) + 63];
+            s->pages_ = reinterpret_cast<page*>(
+                (reinterpret_cast<std::uintptr_t>(s->storage_) + 63) &
+                ~std::uintptr_t(63));
+            for (std::size_t i = s->num_pages_; i-- > 0;)
+            {
+                page* p = new (&s->pages_[i]) page(*s->block_,
+                    reinterpret_cast<char*>(first + i * page_size));
+                p->region_.set_numa_node(uint32_t((std::max)(numa_node_, 0)));
+                p->next_ = free_pages_;
+                free_pages_ = p;
+            }
+            s->span_.base_ = reinterpret_cast<char*>(first);
+            s->span_.chunk_size_ = page_size;
+            s->span_.num_chunks_ = s->num_pages_;
+            s->span_.descriptors_ = reinterpret_cast<char*>(&s->pages_[0].region_);
+            s->span_.stride_ = sizeof(page);
+            if (page_map_ != nullptr)
+            {
+                page_map_->insert(&s->span_);
+            }
+            GHEX_DP_ONLY(small_deb,
+                debug(alloctools::debug::str<>("new slab"),
+                    alloctools::debug::ptr(first), "pages",
+                    alloctools::debug::dec<>(s->num_pages_)));
+            slabs_.push_back(std::move(s));
+            num_slabs_.store(slabs_.size(), std::memory_order_relaxed);
+        }
+
+        domain_type* pd_;
+        std::size_t num_classes_;
+        std::size_t slab_bytes_;
+        int numa_node_;
+        page_policy page_policy_;
+        page_map* page_map_;
+        std::unique_ptr<size_class[]> classes_;
+        mutable std::mutex pages_mutex_;
+        page* free_pages_;
+        std::vector<std::unique_ptr<slab>> slabs_;
+        std::atomic<std::size_t> num_slabs_;
+    };
+
+}}}    // namespace alloctools::rma::detail
@@ -10,35 +10,38 @@
  */
 #pragma once
 
+#include <alloctools/alloctools_fwd.hpp>
 #include <alloctools/config_defines.hpp>
 //
+#include <alloctools/detail/buddy_arena.hpp>
+#include <alloctools/detail/fragmentation_stats.hpp>
+#include <alloctools/detail/heap_profiler.hpp>
+#include <alloctools/detail/latency_histogram.hpp>
 #include <alloctools/detail/memory_block_allocator.hpp>
 #include <alloctools/detail/memory_pool_stack.hpp>
+#include <alloctools/detail/memory_pressure_watcher.hpp>
 #include <alloctools/detail/memory_region_impl.hpp>
-//
-#include <boost/lockfree/stack.hpp>
+#include <alloctools/detail/numa_topology.hpp>
+#include <alloctools/detail/page_map.hpp>
+#include <alloctools/detail/registration_cache.hpp>
+#include <alloctools/detail/size_class_table.hpp>
+#include <alloctools/detail/small_object_heap.hpp>
+#include <alloctools/memory_region_pointer.hpp>
+#include <alloctools/pool_statistics.hpp>
 //
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <sstream>
 #include <stack>
 #include <string>
 #include <mutex>
-#include <unordered_map>
-
-// the default memory chunk size in bytes
-#define RDMA_POOL_1K_CHUNK_SIZE 0x001 * 0x0400        //  1KB
-#define RDMA_POOL_SMALL_CHUNK_SIZE 0x010 * 0x0400     // 16KB
-#define RDMA_POOL_MEDIUM_CHUNK_SIZE 0x040 * 0x0400    // 64KB
-#define RDMA_POOL_LARGE_CHUNK_SIZE 0x400 * 0x0400     //  1MB
-
-#define RDMA_POOL_NUM_1K_CHUNKS 1024
-#define RDMA_POOL_NUM_SMALL_CHUNKS 2048
-#define RDMA_POOL_NUM_MEDIUM_CHUNKS 64
-#define RDMA_POOL_NUM_LARGE_CHUNKS 16
+#include <vector>
 
 namespace alloctools {
     // cppcheck-suppress ConfigurationNotChecked
@@ -66,14 +69,38 @@ namespace alloctools { namespace rma {
         virtual memory_region* get_region(size_t length) = 0;
     };
 
+    // ---------------------------------------------------------------------------
+    // per NUMA node statistics of a memory pool
+    // ---------------------------------------------------------------------------
+    struct numa_node_stats
+    {
+        // registered memory held by the stacks of the node
+        std::size_t registered_bytes;
+        // chunks on the free lists of the node
+        std::size_t free_chunks;
+        // allocations that found a stack of the node empty
+        std::size_t slow_path_count;
+        // allocations by threads on this node served by another node
+        std::size_t steals;
+        // chunks of this node handed to threads on another node
+        std::size_t lent;
+    };
+
     // ---------------------------------------------------------------------------
     // The memory pool manages a collection of memory stacks, each one of which
-    // contains blocks of memory of a fixed size. The memory pool holds 4
-    // stacks and gives them out in response to allocation requests.
+    // contains blocks of memory of a fixed size. The memory pool holds one
+    // stack per size class (powers of two, see size_class_config) and gives
+    // blocks out in response to allocation requests.
     // Individual blocks are pushed/popped to the stack of the right size
     // for the requested data
+    //
+    // A NUMA aware pool holds one set of stacks per node, threads allocate
+    // from the stacks of the node they run on and only take chunks from
+    // other nodes when the local stack is empty. Chunks are always returned
+    // to the stack (node) they came from.
     // ---------------------------------------------------------------------------
-    template <typename RegionProvider, typename T = unsigned char>
+    // the default element type is given in alloctools_fwd.hpp
+    template <typename RegionProvider, typename T>
     struct memory_pool : memory_pool_base
     {
         HPX_NON_COPYABLE(memory_pool);
@@ -85,10 +112,19 @@ namespace alloctools { namespace rma {
         using region_type_impl = detail::memory_region_impl<RegionProvider>;
         using allocator_type   = detail::memory_block_allocator<RegionProvider>;
         using region_ptr       = std::shared_ptr<region_type>;
+        using stack_type =
+            detail::memory_pool_stack<RegionProvider, allocator_type>;
+        using refill_worker_type = typename stack_type::refill_worker_type;
+        using registration_cache_type =
+            detail::registration_cache<RegionProvider>;
+        using small_heap_type = detail::small_object_heap<RegionProvider>;
+        using large_arena_type = detail::buddy_arena<RegionProvider>;
+        using small_pointer = memory_region_pointer<mem_pool_element_type>;
 
         // --------------------------------------------------
         // create a singleton ptr to a memory pool
-        static std::shared_ptr<memory_pool> init_memory_pool(domain_type* pd)
+        static std::shared_ptr<memory_pool> init_memory_pool(domain_type* pd,
+            size_class_config const& config = size_class_config())
         {
             static std::mutex m_init_mutex;
             std::lock_guard<std::mutex> lock(m_init_mutex);
@@ -96,22 +132,101 @@ namespace alloctools { namespace rma {
             if (!instance.get())
             {
                 GHEX_DP_ONLY(pool_deb, debug(alloctools::debug::str<>("New mempool")));
-                instance.reset(new memory_pool(pd));
+                instance.reset(new memory_pool(pd, config));
             }
             return instance;
         }
 
         //----------------------------------------------------------------------------
         // constructor
-        memory_pool(domain_type* pd)
+        memory_pool(domain_type* pd,
+            size_class_config const& config = size_class_config())
           : protection_domain_(pd)
-          , tiny_(pd, RDMA_POOL_NUM_1K_CHUNKS)
-          , small_(pd, RDMA_POOL_NUM_SMALL_CHUNKS)
-          , medium_(pd, RDMA_POOL_NUM_MEDIUM_CHUNKS)
-          , large_(pd, RDMA_POOL_NUM_LARGE_CHUNKS)
+          , size_classes_(config)
+          , num_nodes_(config.numa_aware ?
+                    detail::numa_topology::instance().num_nodes() :
+                    1)
+          , numa_counters_(new numa_counters[num_nodes_])
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+          , allocate_latency_(
+                new detail::latency_histogram[size_classes_.size() + 1])
+          , deallocate_latency_(
+                new detail::latency_histogram[size_classes_.size() + 1])
+#endif
+#ifdef ALLOCTOOLS_HAVE_FRAGMENTATION_STATS
+          , usage_(new detail::size_class_usage_recorder[size_classes_.size()])
+#endif
           , temp_regions(0)
           , user_regions(0)
         {
+#ifdef ALLOCTOOLS_HAVE_FRAGMENTATION_STATS
+            for (std::size_t i = 0; i < size_classes_.size(); ++i)
+            {
+                usage_[i].set_chunk_size(size_classes_.chunk_size(i));
+            }
+#endif
+            // stacks are stored node by node, see stack_index
+            stacks_.reserve(num_nodes_ * size_classes_.size());
+            for (std::size_t node = 0; node < num_nodes_; ++node)
+            {
+                for (std::size_t i = 0; i < size_classes_.size(); ++i)
+                {
+                    stacks_.emplace_back(new stack_type(pd, uint32_t(i),
+                        size_classes_.chunk_size(i), size_classes_.num_chunks(i),
+                        num_nodes_ > 1 ? int(node) : -1, config.slab_pages));
+                    stacks_.back()->set_watermarks(size_classes_.low_watermark(i),
+                        size_classes_.high_watermark(i));
+                    stacks_.back()->set_page_map(&page_map_);
+                }
+            }
+            if (config.background_refill ||
+                config.slab_idle_timeout.count() > 0)
+            {
+                refill_worker_.reset(new refill_worker_type());
+            }
+            if (config.background_refill)
+            {
+                for (auto& stack : stacks_)
+                {
+                    stack->set_refill_worker(refill_worker_.get());
+                }
+            }
+            if (config.slab_idle_timeout.count() > 0)
+            {
+                std::vector<stack_type*> stacks;
+                for (auto& stack : stacks_)
+                {
+                    stacks.push_back(stack.get());
+                }
+                refill_worker_->set_idle_release(
+                    stacks, config.slab_idle_timeout);
+            }
+            if (config.registration_cache_bytes > 0)
+            {
+                rcache_.reset(new registration_cache_type(pd,
+                    config.registration_cache_bytes,
+                    config.registration_cache_entries));
+                rcache_->set_page_map(&page_map_);
+            }
+            if (config.large_arena_bytes > 0)
+            {
+                // blocks start at twice the largest class
+                large_arena_.reset(new large_arena_type(pd,
+                    config.large_arena_bytes, 2 * size_classes_.max_chunk_size(),
+                    -1, config.slab_pages));
+                large_arena_->set_page_map(&page_map_);
+            }
+            if (config.small_object_max_size > 0)
+            {
+                for (std::size_t node = 0; node < num_nodes_; ++node)
+                {
+                    small_heaps_.emplace_back(new small_heap_type(pd,
+                        config.small_object_max_size,
+                        config.small_object_slab_bytes,
+                        num_nodes_ > 1 ? int(node) : -1, config.slab_pages));
+                    small_heaps_.back()->set_page_map(&page_map_);
+                }
+            }
             GHEX_DP_ONLY(pool_deb,
                 debug(alloctools::debug::str<>("initialization"), "complete"));
         }
@@ -126,33 +241,373 @@ namespace alloctools { namespace rma {
         //----------------------------------------------------------------------------
         void deallocate_pools()
         {
-            tiny_.DeallocatePool();
-            small_.DeallocatePool();
-            medium_.DeallocatePool();
-            large_.DeallocatePool();
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            leak_report_ = outstanding_regions();
+#endif
+            // the refill worker must not grow/trim stacks while they are destroyed
+            pressure_watcher_.stop();
+            if (refill_worker_)
+            {
+                refill_worker_->stop();
+            }
+            for (auto& stack : stacks_)
+            {
+                stack->DeallocatePool();
+            }
+            // views that are still held keep the cache alive, see
+            // registration_cache
+            if (rcache_)
+            {
+                rcache_->clear();
+                rcache_->set_page_map(nullptr);
+                rcache_.reset();
+            }
+        }
+
+        //----------------------------------------------------------------------------
+        // the size class table used to route requests to stacks
+        detail::size_class_table const& size_classes() const
+        {
+            return size_classes_;
         }
 
         //----------------------------------------------------------------------------
-        // query the pool for a chunk of a given size to see if one is available
-        // this function is 'unsafe' because it is not thread safe and another
-        // thread may push/pop a block after/during this call and invalidate the result.
-        bool can_allocate_unsafe(size_t length) const
+        // the number of NUMA nodes the pool keeps stacks for (1 if not NUMA aware)
+        std::size_t numa_nodes() const
+        {
+            return num_nodes_;
+        }
+
+        //----------------------------------------------------------------------------
+        // change the low/high watermarks (in chunks) of a size class,
+        // on every node
+        void set_watermarks(std::size_t size_class, std::size_t low,
+            std::size_t high)
+        {
+            for (std::size_t node = 0; node < num_nodes_; ++node)
+            {
+                stacks_[stack_index(node, size_class)]->set_watermarks(low, high);
+            }
+        }
+
+        //----------------------------------------------------------------------------
+        // the number of times an allocation of the given size class found
+        // its stack empty and had to fall back to the slow path
+        std::size_t slow_path_count(std::size_t size_class) const
+        {
+            std::size_t count = 0;
+            for (std::size_t node = 0; node < num_nodes_; ++node)
+            {
+                count += stacks_[stack_index(node, size_class)]->slow_path_count();
+            }
+            return count;
+        }
+
+        //----------------------------------------------------------------------------
+        // latencies (in ns) of an operation on a size class, merged over all
+        // nodes. size_class == size_classes().size() selects requests larger
+        // than the largest class, registration ignores the size class.
+        // Empty unless ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS is defined
+        latency_snapshot latency_statistics(
+            pool_operation op, std::size_t size_class = 0) const
+        {
+            latency_snapshot result;
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            size_class = (std::min)(size_class, size_classes_.size());
+            switch (op)
+            {
+            case pool_operation::allocate:
+                result = allocate_latency_[size_class].snapshot();
+                break;
+            case pool_operation::deallocate:
+                result = deallocate_latency_[size_class].snapshot();
+                break;
+            case pool_operation::grow:
+                for (std::size_t node = 0;
+                     node < num_nodes_ && size_class < size_classes_.size(); ++node)
+                {
+                    result.merge(
+                        stacks_[stack_index(node, size_class)]->grow_latency());
+                }
+                break;
+            case pool_operation::registration:
+                result = registration_latency_.snapshot();
+                break;
+            }
+#else
+            (void) op;
+            (void) size_class;
+#endif
+            return result;
+        }
+
+        //----------------------------------------------------------------------------
+        // failed CAS operations on the free lists of a size class (contention),
+        // always 0 unless ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS is defined
+        std::uint64_t free_list_cas_retries(std::size_t size_class) const
+        {
+            std::uint64_t count = 0;
+            for (std::size_t node = 0; node < num_nodes_; ++node)
+            {
+                count += stacks_[stack_index(node, size_class)]->cas_retries();
+            }
+            return count;
+        }
+
+        //----------------------------------------------------------------------------
+        // clear all latency histograms (for measuring one phase of a program)
+        void reset_latency_histograms()
         {
-            if (length <= tiny_.chunk_size())
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            for (std::size_t i = 0; i <= size_classes_.size(); ++i)
             {
-                return !tiny_.free_list_.empty();
+                allocate_latency_[i].reset();
+                deallocate_latency_[i].reset();
             }
-            else if (length <= small_.chunk_size())
+            registration_latency_.reset();
+            for (auto& stack : stacks_)
             {
-                return !small_.free_list_.empty();
+                stack->reset_latency_histograms();
             }
-            else if (length <= medium_.chunk_size())
+#endif
+        }
+
+        //----------------------------------------------------------------------------
+        // message lengths and wasted bytes of the chunks of a size class (or
+        // of all classes), recorded when chunks are returned to the pool.
+        // Empty unless ALLOCTOOLS_HAVE_FRAGMENTATION_STATS is defined
+        size_class_usage usage_statistics(std::size_t size_class) const
+        {
+#ifdef ALLOCTOOLS_HAVE_FRAGMENTATION_STATS
+            return usage_[size_class].snapshot();
+#else
+            size_class_usage usage;
+            usage.chunk_size_ = size_classes_.chunk_size(size_class);
+            return usage;
+#endif
+        }
+
+        std::vector<size_class_usage> usage_statistics() const
+        {
+            std::vector<size_class_usage> usage;
+            for (std::size_t i = 0; i < size_classes_.size(); ++i)
+            {
+                usage.push_back(usage_statistics(i));
+            }
+            return usage;
+        }
+
+        //----------------------------------------------------------------------------
+        // predict the footprint of the recorded messages if the pool used
+        // chunk_sizes (ascending) instead of its current size classes
+        fragmentation_forecast forecast_fragmentation(
+            std::vector<std::size_t> const& chunk_sizes) const
+        {
+            return rma::forecast_fragmentation(usage_statistics(), chunk_sizes);
+        }
+
+        void reset_usage_statistics()
+        {
+#ifdef ALLOCTOOLS_HAVE_FRAGMENTATION_STATS
+            for (std::size_t i = 0; i < size_classes_.size(); ++i)
+            {
+                usage_[i].reset();
+            }
+#endif
+        }
+
+        //----------------------------------------------------------------------------
+        // memory and allocation statistics of the stacks of one node
+        numa_node_stats numa_statistics(std::size_t node) const
+        {
+            numa_node_stats stats = {0, 0, 0, 0, 0};
+            for (std::size_t i = 0; i < size_classes_.size(); ++i)
+            {
+                stack_type const& stack = *stacks_[stack_index(node, i)];
+                stats.registered_bytes += stack.registered_bytes();
+                stats.free_chunks += std::size_t((std::max)(
+                    stack.free_count_.load(std::memory_order_relaxed),
+                    std::ptrdiff_t(0)));
+                stats.slow_path_count += stack.slow_path_count();
+            }
+            stats.steals =
+                numa_counters_[node].steals_.load(std::memory_order_relaxed);
+            stats.lent = numa_counters_[node].lent_.load(std::memory_order_relaxed);
+            return stats;
+        }
+
+        //----------------------------------------------------------------------------
+        // bytes of registered memory held by the size class stacks
+        std::size_t registered_bytes() const
+        {
+            std::size_t bytes = 0;
+            for (auto& stack : stacks_)
+            {
+                bytes += stack->registered_bytes();
+            }
+            return bytes;
+        }
+
+        //----------------------------------------------------------------------------
+        // the pool chunks that are allocated and have not been returned, with
+        // the age and call site of the max_entries oldest of them. The call
+        // site is the return address of allocate_region/allocate_regions.
+        // Without ALLOCTOOLS_HAVE_REGION_TRACKING only the count is known
+        // (and only when performance counters are enabled)
+        outstanding_report outstanding_regions(std::size_t max_entries = 16) const
+        {
+            outstanding_report report;
+            for (auto& stack : stacks_)
+            {
+                outstanding_report r;
+                stack->outstanding(r, max_entries);
+                report.merge(r, max_entries);
+            }
+            return report;
+        }
+
+        //----------------------------------------------------------------------------
+        // the chunks that were outstanding when deallocate_pools was called
+        // (empty unless ALLOCTOOLS_HAVE_REGION_TRACKING is defined)
+        outstanding_report const& leak_report() const
+        {
+            return leak_report_;
+        }
+
+        //----------------------------------------------------------------------------
+        // sample the call stack of allocate_region/allocate_regions on average
+        // once every sample_bytes bytes (of region size) and keep the samples
+        // of the regions that are still allocated, see heap_profiler.
+        // A no-op unless ALLOCTOOLS_HAVE_HEAP_PROFILER is defined
+        void start_heap_profile(std::size_t sample_bytes = 0x80000)
+        {
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+            profiler_.start(sample_bytes);
+#else
+            (void) sample_bytes;
+#endif
+        }
+
+        void stop_heap_profile()
+        {
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+            profiler_.stop();
+#endif
+        }
+
+        // write the estimated registered memory held by each call stack
+        void write_heap_profile(std::ostream& os,
+            heap_profile_format format = heap_profile_format::folded) const
+        {
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+            profiler_.write(os, format);
+#else
+            (void) os;
+            (void) format;
+#endif
+        }
+
+        //----------------------------------------------------------------------------
+        // the counters of every stack and of the pool, read with relaxed loads
+        // and without locks so that it can be called periodically while other
+        // threads allocate, see write_json and write_prometheus
+        pool_statistics statistics() const
+        {
+            pool_statistics stats;
+            stats.classes.reserve(stacks_.size());
+            for (auto& stack : stacks_)
+            {
+                stats.classes.push_back(stack->statistics());
+                stats.registered_bytes += stats.classes.back().registered_bytes;
+            }
+            stats.performance_counters = PERFORMANCE_COUNTER_ENABLED;
+            stats.temp_regions = temp_regions.load(std::memory_order_relaxed);
+            for (auto& heap : small_heaps_)
+            {
+                stats.small_object_bytes += heap->registered_bytes();
+            }
+            if (large_arena_)
+            {
+                stats.large_arena_bytes = large_arena_->size();
+                stats.large_arena_used_bytes = large_arena_->used_bytes();
+            }
+            return stats;
+        }
+
+        //----------------------------------------------------------------------------
+        // release completely free slabs (largest classes first) until the
+        // pool holds no more than target_bytes of registered memory, or no
+        // more free slabs are found. Returns the number of bytes released.
+        // Regions cached by the calling thread are returned first, regions
+        // held in other threads' caches keep their slabs alive.
+        std::size_t trim(std::size_t target_bytes)
+        {
+            for (auto& stack : stacks_)
+            {
+                stack->flush_local_cache();
+            }
+            std::size_t total = registered_bytes();
+            std::size_t released = 0;
+            for (std::size_t i = size_classes_.size(); i-- > 0;)
+            {
+                for (std::size_t node = 0;
+                     node < num_nodes_ && total > target_bytes; ++node)
+                {
+                    std::size_t bytes =
+                        stacks_[stack_index(node, i)]->release_slabs(
+                            total - target_bytes,
+                            (std::numeric_limits<std::int64_t>::max)());
+                    total -= (std::min)(bytes, total);
+                    released += bytes;
+                }
+            }
+            GHEX_DP_ONLY(pool_deb,
+                debug(alloctools::debug::str<>("Trim"), "released",
+                    alloctools::debug::hex<8>(released), "registered",
+                    alloctools::debug::hex<8>(total)));
+            return released;
+        }
+
+        //----------------------------------------------------------------------------
+        // release slabs that have been completely free for at least idle
+        std::size_t release_idle_slabs(std::chrono::milliseconds idle)
+        {
+            std::int64_t idle_before = stack_type::now_ns() -
+                std::chrono::duration_cast<std::chrono::nanoseconds>(idle)
+                    .count();
+            std::size_t released = 0;
+            for (auto& stack : stacks_)
             {
-                return !medium_.free_list_.empty();
+                released += stack->release_slabs(
+                    (std::numeric_limits<std::size_t>::max)(), idle_before);
             }
-            else if (length <= large_.chunk_size())
+            return released;
+        }
+
+        //----------------------------------------------------------------------------
+        // trim the pool to target_bytes whenever the kernel reports memory
+        // pressure (Linux PSI), path may be a cgroup memory.pressure file.
+        // returns false if pressure information is not available
+        bool watch_memory_pressure(std::size_t target_bytes,
+            std::string const& path = "/proc/pressure/memory")
+        {
+            return pressure_watcher_.start(
+                [this, target_bytes]() { trim(target_bytes); }, path);
+        }
+
+        //----------------------------------------------------------------------------
+        // query the pool for a chunk of a given size to see if one is available
+        // this function is 'unsafe' because it is not thread safe and another
+        // thread may push/pop a block after/during this call and invalidate the result.
+        // The calling thread's magazine and the shared free list are checked,
+        // chunks cached by other threads are not, so false is not a guarantee
+        // that the stack is empty.
+        bool can_allocate_unsafe(size_t length) const
+        {
+            std::size_t index = size_classes_.index(length);
+            if (index < size_classes_.size())
             {
-                return !large_.free_list_.empty();
+                return stacks_[stack_index(local_node(), index)]->has_free_unsafe();
             }
             return true;
         }
@@ -163,32 +618,35 @@ namespace alloctools { namespace rma {
         {
             region_type* region = nullptr;
             //
-            if (length <= tiny_.chunk_size())
+            std::size_t index = size_classes_.index(length);
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            detail::latency_timer timer(
+                allocate_latency_[(std::min)(index, size_classes_.size())]);
+#endif
+            if (index < size_classes_.size())
             {
-                region = tiny_.pop();
+                region = (num_nodes_ == 1) ? stacks_[index]->pop() :
+                                             pop_numa(index);
             }
-            else if (length <= small_.chunk_size())
+            else if (large_arena_)
             {
-                region = small_.pop();
-            }
-            else if (length <= medium_.chunk_size())
-            {
-                region = medium_.pop();
-            }
-            else if (length <= large_.chunk_size())
-            {
-                region = large_.pop();
+                region = large_arena_->allocate(length);
             }
             // if we didn't get a block from the cache, create one on the fly
             if (region == nullptr)
             {
                 region = allocate_temporary_region(length);
             }
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            set_call_site(region, ALLOCTOOLS_CALL_SITE());
+#endif
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+            profiler_.allocated(region);
+#endif
 
             GHEX_DP_ONLY(pool_deb,
                 trace(alloctools::debug::str<>("Popping Block"), *region,
-                    tiny_.status(), small_.status(), medium_.status(),
-                    large_.status(), "temp regions",
+                    status(), "temp regions",
                     alloctools::debug::dec<>(temp_regions)));
 
             return region;
@@ -198,6 +656,34 @@ namespace alloctools { namespace rma {
         // release a region back to the pool
         void deallocate(region_type* region)
         {
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+            profiler_.released(region);
+#endif
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            detail::latency_timer timer(deallocate_latency_[is_pool_chunk(region) ?
+                    region->get_size_class() :
+                    size_classes_.size()]);
+#endif
+            // a view of a cached registration, drop the reference
+            if (region->get_cached_region())
+            {
+                GHEX_DP_ONLY(pool_deb,
+                    trace(alloctools::debug::str<>("Releasing"), "CACHED",
+                        *region));
+                registration_cache_type::release(region);
+                return;
+            }
+
+            // a block of the large object arena
+            if (region->get_arena_region())
+            {
+                GHEX_DP_ONLY(pool_deb,
+                    trace(alloctools::debug::str<>("Releasing"), "ARENA",
+                        *region));
+                large_arena_->deallocate(region);
+                return;
+            }
+
             // if this region was registered on the fly, then don't return it to the pool
             if (region->get_temp_region() || region->get_user_region())
             {
@@ -216,33 +702,182 @@ namespace alloctools { namespace rma {
                         trace(alloctools::debug::str<>("Deleting"), "USER", *region,
                             "user regions", alloctools::debug::dec<>(user_regions)));
                 }
+                page_map_.erase(region);
                 delete region;
                 return;
             }
 
-            // put the block back on the free list
-            if (region->get_size() <= tiny_.chunk_size())
+            // put the block back on the free list of its size class (and node)
+            record_usage(region);
+            stacks_[stack_index(region->get_numa_node(),
+                        region->get_size_class())]
+                ->push(region);
+
+            GHEX_DP_ONLY(pool_deb,
+                trace(alloctools::debug::str<>("Pushing Block"), *region,
+                    status(), "temp regions",
+                    alloctools::debug::dec<>(temp_regions)));
+        }
+
+        //----------------------------------------------------------------------------
+        // allocate count regions of the same length into out, regions from a
+        // size class are popped from its stack in one batch (one CAS on the
+        // free list), regions that the stack cannot provide are allocated
+        // one at a time as in allocate_region
+        void allocate_regions(std::size_t count, std::size_t length, region_type** out)
+        {
+            std::size_t done = 0;
+            std::size_t index = size_classes_.index(length);
+            if (index < size_classes_.size())
             {
-                tiny_.push(region);
+                // a NUMA aware pool only takes the local batch here, missing
+                // regions are stolen from other nodes below
+                done = (num_nodes_ == 1) ?
+                    stacks_[index]->pop(out, count) :
+                    stacks_[stack_index(local_node(), index)]->pop(out, count, false);
             }
-            else if (region->get_size() <= small_.chunk_size())
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+            // the regions allocated one at a time below are sampled there
+            for (std::size_t i = 0; i < done; ++i)
             {
-                small_.push(region);
+                profiler_.allocated(out[i]);
             }
-            else if (region->get_size() <= medium_.chunk_size())
+#endif
+            for (; done < count; ++done)
             {
-                medium_.push(region);
+                out[done] = allocate_region(length);
             }
-            else if (region->get_size() <= large_.chunk_size())
+#ifdef ALLOCTOOLS_HAVE_REGION_TRACKING
+            void const* site = ALLOCTOOLS_CALL_SITE();
+            for (std::size_t i = 0; i < count; ++i)
             {
-                large_.push(region);
+                set_call_site(out[i], site);
             }
+#endif
+        }
 
-            GHEX_DP_ONLY(pool_deb,
-                trace(alloctools::debug::str<>("Pushing Block"), *region,
-                    tiny_.status(), small_.status(), medium_.status(),
-                    large_.status(), "temp regions",
-                    alloctools::debug::dec<>(temp_regions)));
+        //----------------------------------------------------------------------------
+        // vectored form, out[i] gets a region of lengths[i] bytes, runs of
+        // consecutive lengths in the same size class are popped as one batch
+        void allocate_regions(
+            std::size_t const* lengths, std::size_t count, region_type** out)
+        {
+            std::size_t i = 0;
+            while (i < count)
+            {
+                std::size_t index = size_classes_.index(lengths[i]);
+                std::size_t run = 1;
+                while (i + run < count &&
+                    size_classes_.index(lengths[i + run]) == index)
+                {
+                    ++run;
+                }
+                if (index < size_classes_.size())
+                {
+                    allocate_regions(run, lengths[i], out + i);
+                }
+                else
+                {
+                    for (std::size_t j = i; j < i + run; ++j)
+                    {
+                        out[j] = allocate_region(lengths[j]);
+                    }
+                }
+                i += run;
+            }
+        }
+
+        //----------------------------------------------------------------------------
+        // release count regions, runs of consecutive pool regions that belong
+        // to the same stack are pushed as one batch
+        void release_regions(region_type** regions, std::size_t count)
+        {
+            std::size_t i = 0;
+            while (i < count)
+            {
+                region_type* region = regions[i];
+                if (!is_pool_chunk(region))
+                {
+                    deallocate(region);
+                    ++i;
+                    continue;
+                }
+                std::size_t stack = stack_index(
+                    region->get_numa_node(), region->get_size_class());
+                std::size_t run = 1;
+                while (i + run < count &&
+                    is_pool_chunk(regions[i + run]) &&
+                    stack_index(regions[i + run]->get_numa_node(),
+                        regions[i + run]->get_size_class()) == stack)
+                {
+                    ++run;
+                }
+                for (std::size_t j = i; j < i + run; ++j)
+                {
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+                    profiler_.released(regions[j]);
+#endif
+                    record_usage(regions[j]);
+                }
+                stacks_[stack]->push(regions + i, regions + i + run);
+                i += run;
+            }
+        }
+
+        //----------------------------------------------------------------------------
+        // allocate an object that is smaller than a pool chunk, it is packed
+        // with other objects of similar size into a registered page and the
+        // region of the pointer is shared by the whole page (it carries the
+        // keys, the address is in the pointer). Larger objects, or all
+        // objects when the small object heap is disabled, get a region of
+        // their own. Must be released with deallocate_small
+        small_pointer allocate_small(std::size_t length)
+        {
+            if (!small_heaps_.empty() &&
+                length <= small_heaps_.front()->max_object_size())
+            {
+                region_type* region = nullptr;
+                void* address =
+                    small_heaps_[local_node()]->allocate(length, region);
+                return small_pointer(
+                    static_cast<mem_pool_element_type*>(address), region);
+            }
+            region_type* region = allocate_region(length);
+            return small_pointer(
+                reinterpret_cast<mem_pool_element_type*>(region->get_address()),
+                region);
+        }
+
+        //----------------------------------------------------------------------------
+        void deallocate_small(small_pointer p)
+        {
+            if (p.region_->get_small_region())
+            {
+                small_heaps_[p.region_->get_numa_node()]->deallocate(
+                    p.pointer_, p.region_);
+                return;
+            }
+            deallocate(p.region_);
+        }
+
+        //----------------------------------------------------------------------------
+        // the arena for requests larger than the largest class, nullptr when
+        // it is not enabled
+        large_arena_type const* large_arena() const
+        {
+            return large_arena_.get();
+        }
+
+        //----------------------------------------------------------------------------
+        // for debug log messages
+        std::string status()
+        {
+            std::string temp;
+            for (auto& stack : stacks_)
+            {
+                temp += stack->status() + " ";
+            }
+            return temp;
         }
 
         //----------------------------------------------------------------------------
@@ -250,9 +885,13 @@ namespace alloctools { namespace rma {
         // when deallocted, it will be unregistered and deleted, not returned to the pool
         region_type* allocate_temporary_region(std::size_t length)
         {
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            detail::latency_timer timer(registration_latency_);
+#endif
             region_type_impl* region = new region_type_impl();
             region->set_temp_region();
             region->allocate(protection_domain_, length);
+            page_map_.insert(region);
             ++temp_regions;
             GHEX_DP_ONLY(pool_deb,
                 trace(alloctools::debug::str<>("Allocating"), "TEMP", *region,
@@ -262,13 +901,25 @@ namespace alloctools { namespace rma {
 
         //----------------------------------------------------------------------------
         // registers a user allocated address and returns a region,
-        // it will be unregistered and deleted, not returned to the pool
+        // it will be unregistered and deleted, not returned to the pool.
+        // With the registration cache enabled, the registration is kept
+        // for reuse by later calls with the same (or covered) memory, the
+        // caller must then call invalidate_registrations before the memory
+        // is freed or unmapped (the cache cannot detect it)
         region_type* register_temporary_region(
             const void* ptr, std::size_t length)
         {
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+            detail::latency_timer timer(registration_latency_);
+#endif
+            if (rcache_)
+            {
+                return rcache_->acquire(ptr, length);
+            }
             region_type* region =
                 new region_type_impl(protection_domain_, ptr, length);
             region->set_temp_region();
+            page_map_.insert(region);
             ++temp_regions;
             GHEX_DP_ONLY(pool_deb,
                 trace(alloctools::debug::str<>("Registered"), "TEMP", *region,
@@ -276,102 +927,221 @@ namespace alloctools { namespace rma {
             return region;
         }
 
+        //----------------------------------------------------------------------------
+        // drop cached registrations of [ptr, ptr+length), must be called
+        // before memory passed to register_temporary_region is freed or
+        // unmapped, a no-op when the registration cache is disabled
+        void invalidate_registrations(const void* ptr, std::size_t length)
+        {
+            if (rcache_)
+            {
+                rcache_->invalidate(ptr, length);
+            }
+        }
+
+        //----------------------------------------------------------------------------
+        // the registration cache, nullptr when it is not enabled
+        registration_cache_type* registration_cache() const
+        {
+            return rcache_.get();
+        }
+
+        //----------------------------------------------------------------------------
+        // region_type is memory_region, so no cast is needed
         void release_region(memory_region* region) override
         {
-            deallocate(dynamic_cast<region_type*>(region));
+            deallocate(region);
         }
 
         //----------------------------------------------------------------------------
         // provide only to allow base class to return a region, without making main
         // region allocate virtual for normal use
-        memory_region* get_region(size_t length)
+        memory_region* get_region(size_t length) override
         {
             return allocate_region(length);
         }
 
         //----------------------------------------------------------------------------
-        // find a memory_region* from the memory address it wraps
-        // DEPRECATED : Left for posible reuse
-        // this is only valid for regions allocated using the STL allocate method
-        // and if you are using this, then you probably should have allocated
-        // a region instead in the first place
-        memory_region* region_from_address(void const* addr)
+        // find the memory_region* containing an address (interior addresses
+        // are fine), this covers pool chunks, arena blocks, temporary and
+        // user regions.
+        // Regions may share pages. For memory in the registration cache the
+        // region of the whole cached registration is returned (it has the
+        // same keys as the views of it).
+        // Returns nullptr if the address is not in registered memory
+        memory_region* region_from_address(void const* addr) const
         {
-            /*
-            throw(std::runtime_error(
-                "Don't use region_from_address for benchmarks"));
-            GHEX_DP_ONLY(pool_deb,
-                trace(alloctools::debug::str<>("Expensive"), "region_from_address"));
-            auto present = region_alloc_pointer_map_.is_in_map(addr);
-            if (present.second)
+            memory_region* region = page_map_.lookup(addr);
+            if (region == nullptr)
             {
                 GHEX_DP_ONLY(pool_deb,
-                    trace(alloctools::debug::str<>("Found in map"),
-                        alloctools::debug::ptr(addr), *(present.first->second)));
-                return (present.first->second);
+                    debug(alloctools::debug::str<>("Not found in map"),
+                        alloctools::debug::ptr(addr)));
             }
-            pool_deb.error(alloctools::debug::str<>("Not found in map"),
-                alloctools::debug::ptr(addr), "region_from_address returning nullptr");
-            */
-            throw std::runtime_error("We do not support raw pointers");
-            return nullptr;
+            return region;
         }
 
+        //----------------------------------------------------------------------------
+        // make addr (which must be inside region) resolvable by
+        // region_from_address, only the page holding addr is mapped. Every
+        // call must be matched by remove_address_from_map with the same
+        // arguments. Regions allocated or registered by the pool are always
+        // resolvable and need not be added.
         void add_address_to_map(void const* addr, region_type* region)
         {
-            throw(std::runtime_error(
-                "Don't use add_address_to_map for benchmarks"));
-            /*
-            GHEX_DP_ONLY(pool_deb,
-                trace(alloctools::debug::str<>("Expensive"), "add_address_to_map",
-                    alloctools::debug::ptr(addr), *region));
-            std::pair<void const*, region_type*> val(addr, region);
-            region_alloc_pointer_map_.insert(val);
-            */
+            page_map_.insert(addr, region);
         }
 
         void remove_address_from_map(void const* addr, memory_region* region)
         {
-            throw(std::runtime_error(
-                "Don't use remove_address_from_map for benchmarks"));
-            /*
-            GHEX_DP_ONLY(pool_deb,
-                trace(alloctools::debug::str<>("map contents"),
-                    region_alloc_pointer_map_.debug_map()));
-            GHEX_DP_ONLY(pool_deb,
-                trace(alloctools::debug::str<>("Expensive"), "remove_address_from_map",
-                    alloctools::debug::ptr(addr), *region));
-            region_alloc_pointer_map_.erase(addr);
-            */
+            page_map_.erase(addr, region);
+        }
+
+        //----------------------------------------------------------------------------
+        // true for regions that belong to the size class stacks
+        static inline bool is_pool_chunk(region_type const* region)
+        {
+            return !(region->get_cached_region() || region->get_arena_region() ||
+                region->get_temp_region() || region->get_user_region());
+        }
+
+        //----------------------------------------------------------------------------
+        // record the call site of a chunk that is being handed out
+        inline void set_call_site(region_type* region, void const* site)
+        {
+            if (is_pool_chunk(region))
+            {
+                stacks_[stack_index(region->get_numa_node(),
+                            region->get_size_class())]
+                    ->set_call_site(region, site);
+            }
+        }
+
+        //----------------------------------------------------------------------------
+        // account for the message length of a chunk that is being released,
+        // the length is cleared so that the next user starts without one
+        inline void record_usage(region_type* region)
+        {
+#ifdef ALLOCTOOLS_HAVE_FRAGMENTATION_STATS
+            usage_[region->get_size_class()].record(region->get_message_length());
+            region->set_message_length(0);
+#else
+            (void) region;
+#endif
+        }
+
+        //----------------------------------------------------------------------------
+        // index into stacks_ of a size class on a node
+        inline std::size_t stack_index(std::size_t node, std::size_t size_class) const
+        {
+            return node * size_classes_.size() + size_class;
+        }
+
+        // the node index of the calling thread (0 if the pool is not NUMA aware)
+        inline std::size_t local_node() const
+        {
+            if (num_nodes_ == 1)
+                return 0;
+            return std::size_t(detail::numa_topology::current_node());
+        }
+
+        //----------------------------------------------------------------------------
+        // take a chunk from the local node, if its stack is empty take one
+        // from another node before growing the local stack. When a refill
+        // worker is attached, the local stack is refilled in the background
+        // while chunks are borrowed from other nodes
+        region_type* pop_numa(std::size_t index)
+        {
+            const std::size_t node = local_node();
+            stack_type* local = stacks_[stack_index(node, index)].get();
+            region_type* region = local->pop(false);
+            if (region != nullptr)
+            {
+                return region;
+            }
+            for (std::size_t i = 1; i < num_nodes_; ++i)
+            {
+                const std::size_t other = (node + i) % num_nodes_;
+                region = stacks_[stack_index(other, index)]->pop(false);
+                if (region != nullptr)
+                {
+                    numa_counters_[node].steals_.fetch_add(
+                        1, std::memory_order_relaxed);
+                    numa_counters_[other].lent_.fetch_add(
+                        1, std::memory_order_relaxed);
+                    GHEX_DP_ONLY(pool_deb,
+                        debug(alloctools::debug::str<>("NUMA steal"), "node",
+                            alloctools::debug::dec<>(node), "from",
+                            alloctools::debug::dec<>(other), *region));
+                    return region;
+                }
+            }
+            return local->pop();
         }
 
         //----------------------------------------------------------------------------
         // protection domain that memory is registered with
         domain_type* protection_domain_;
 
-        // maintain 4 pools of thread safe pre-allocated regions of fixed size.
-        detail::memory_pool_stack<RegionProvider, allocator_type,
-            detail::pool_tiny, RDMA_POOL_1K_CHUNK_SIZE>
-            tiny_;
-        detail::memory_pool_stack<RegionProvider, allocator_type,
-            detail::pool_small, RDMA_POOL_SMALL_CHUNK_SIZE>
-            small_;
-        detail::memory_pool_stack<RegionProvider, allocator_type,
-            detail::pool_medium, RDMA_POOL_MEDIUM_CHUNK_SIZE>
-            medium_;
-        detail::memory_pool_stack<RegionProvider, allocator_type,
-            detail::pool_large, RDMA_POOL_LARGE_CHUNK_SIZE>
-            large_;
+        // maps a requested length to the index of a stack
+        detail::size_class_table size_classes_;
+
+        // number of NUMA nodes with their own stacks
+        std::size_t num_nodes_;
+
+        // address to region lookup for pool chunks, temporary and user regions
+        detail::page_map page_map_;
+
+        // one stack of thread safe pre-allocated regions per size class
+        // (and per node), see stack_index
+        std::vector<std::unique_ptr<stack_type>> stacks_;
+
+        // cross node counters, one cache line per node
+        struct alignas(64) numa_counters
+        {
+            std::atomic<std::size_t> steals_{0};
+            std::atomic<std::size_t> lent_{0};
+        };
+        std::unique_ptr<numa_counters[]> numa_counters_;
+
+        // optional background thread that grows stacks below their low watermark
+        std::unique_ptr<refill_worker_type> refill_worker_;
+
+        // optional trimming of the pool when the system is short of memory
+        detail::memory_pressure_watcher pressure_watcher_;
+
+        // optional cache of user memory registrations
+        std::shared_ptr<registration_cache_type> rcache_;
+
+        // optional heaps of objects smaller than a chunk, one per node
+        std::vector<std::unique_ptr<small_heap_type>> small_heaps_;
+
+        // optional arena for requests larger than the largest class
+        std::unique_ptr<large_arena_type> large_arena_;
+
+#ifdef ALLOCTOOLS_HAVE_LATENCY_HISTOGRAMS
+        // per size class (and one for larger requests) and registration latencies
+        std::unique_ptr<detail::latency_histogram[]> allocate_latency_;
+        std::unique_ptr<detail::latency_histogram[]> deallocate_latency_;
+        detail::latency_histogram registration_latency_;
+#endif
+
+#ifdef ALLOCTOOLS_HAVE_FRAGMENTATION_STATS
+        // message lengths of released chunks, per size class
+        std::unique_ptr<detail::size_class_usage_recorder[]> usage_;
+#endif
+
+        // chunks not returned when the pool was deallocated
+        outstanding_report leak_report_;
+
+#ifdef ALLOCTOOLS_HAVE_HEAP_PROFILER
+        // optional sampling of the call stacks that hold regions
+        detail::heap_profiler profiler_;
+#endif
 
         // counters
         std::atomic<uint32_t> temp_regions;
         std::atomic<uint32_t> user_regions;
-
-        //----------------------------------------------------------------------------
-        // used to map the internal memory address to the region that
-        // holds the registration information
-//        alloctools::concurrent::unordered_map<const void*, region_type*>
-//            region_alloc_pointer_map_;
     };
 
 }}    // namespace alloctools::rma
@@ -13,10 +13,23 @@
 #include <alloctools/debugging/print.hpp>
 #include <alloctools/traits/memory_region_traits.hpp>
 //
+#include <atomic>
+#include <cstdint>
 #include <iomanip>
 #include <memory>
 
 namespace alloctools { namespace rma {
+    // --------------------------------------------------------------------
+    // the registration descriptor and key of a registered block, read from
+    // the provider once and shared by the block and every partial region
+    // carved from it (so they cost one pointer per region descriptor)
+    // --------------------------------------------------------------------
+    struct region_keys
+    {
+        void* local_key_;
+        uint64_t remote_key_;
+    };
+
     // --------------------------------------------------------------------
     // a base class that provides an API for creating/accessing
     // pinned memory blocks. This will be overridden by concrete
@@ -32,24 +45,41 @@ namespace alloctools { namespace rma {
             BLOCK_USER = 1,
             BLOCK_TEMP = 2,
             BLOCK_PARTIAL = 4,
+            BLOCK_MAPPED = 8,
+            BLOCK_CACHED = 16,
+            BLOCK_SMALL = 32,
+            BLOCK_ARENA = 64,
+            BLOCK_SAMPLED = 128,
+            BLOCK_KEYS = 256,
+            BLOCK_RESOURCE = 512,
         };
 
         memory_region()
-          : address_(nullptr)
-          , base_addr_(nullptr)
+          : next_(nullptr)
+          , address_(nullptr)
           , size_(0)
-          , used_space_(0)
           , flags_(0)
+          , size_class_(0)
+          , used_space_(0)
+          , slab_index_(0)
+          , numa_node_(0)
+          , keys_(no_keys())
+          , base_addr_(nullptr)
         {
         }
 
         memory_region(
             char* address, char* base_address, uint64_t size, uint32_t flags)
-          : address_(address)
-          , base_addr_(base_address)
+          : next_(nullptr)
+          , address_(address)
           , size_(size)
-          , used_space_(0)
           , flags_(flags)
+          , size_class_(0)
+          , used_space_(0)
+          , slab_index_(0)
+          , numa_node_(0)
+          , keys_(no_keys())
+          , base_addr_(base_address)
         {
         }
 
@@ -135,13 +165,126 @@ namespace alloctools { namespace rma {
             return (flags_ & BLOCK_PARTIAL) == BLOCK_PARTIAL;
         }
 
+        // --------------------------------------------------------------------
+        // a mapped region owns memory that was obtained with mmap (for example
+        // to bind it to a NUMA node) and must be unmapped rather than deleted
+        inline void set_mapped_region()
+        {
+            flags_ |= BLOCK_MAPPED;
+        }
+
+        inline bool get_mapped_region() const
+        {
+            return (flags_ & BLOCK_MAPPED) == BLOCK_MAPPED;
+        }
+
+        // --------------------------------------------------------------------
+        // a cached region is a view of a registration held by the registration
+        // cache of a pool, releasing it only drops a reference
+        inline bool get_cached_region() const
+        {
+            return (flags_ & BLOCK_CACHED) == BLOCK_CACHED;
+        }
+
+        // --------------------------------------------------------------------
+        // a small region is a page of the small object heap of a pool, it is
+        // shared by all the objects in the page and is never released alone
+        inline bool get_small_region() const
+        {
+            return (flags_ & BLOCK_SMALL) == BLOCK_SMALL;
+        }
+
+        // --------------------------------------------------------------------
+        // an arena region is a block of the large object arena of a pool
+        inline bool get_arena_region() const
+        {
+            return (flags_ & BLOCK_ARENA) == BLOCK_ARENA;
+        }
+
+        // --------------------------------------------------------------------
+        // a sampled region is in the live samples of the heap profiler of
+        // its pool, set while the region is allocated
+        inline void set_sampled_region(bool sampled)
+        {
+            flags_ = sampled ? (flags_ | BLOCK_SAMPLED) :
+                               (flags_ & ~uint64_t(BLOCK_SAMPLED));
+        }
+
+        inline bool get_sampled_region() const
+        {
+            return (flags_ & BLOCK_SAMPLED) == BLOCK_SAMPLED;
+        }
+
+        // --------------------------------------------------------------------
+        // a resource region was handed out by a memory_region_resource and
+        // not yet deallocated by one
+        inline void set_resource_region(bool resource)
+        {
+            flags_ = resource ? (flags_ | BLOCK_RESOURCE) :
+                                (flags_ & ~uint64_t(BLOCK_RESOURCE));
+        }
+
+        inline bool get_resource_region() const
+        {
+            return (flags_ & BLOCK_RESOURCE) == BLOCK_RESOURCE;
+        }
+
+        // --------------------------------------------------------------------
+        // the index of the memory pool size class this region belongs to,
+        // only meaningful for regions that are managed by a pool
+        // (classes are powers of two, so 8 bits are plenty)
+        inline void set_size_class(uint32_t index)
+        {
+            size_class_ = index;
+        }
+
+        inline uint32_t get_size_class() const
+        {
+            return size_class_;
+        }
+
+        // --------------------------------------------------------------------
+        // the index of the slab (within its size class) that a pool region
+        // was carved from, used to track how many chunks of a slab are free
+        // (24 bits)
+        inline void set_slab_index(uint32_t index)
+        {
+            slab_index_ = index;
+        }
+
+        inline uint32_t get_slab_index() const
+        {
+            return slab_index_;
+        }
+
+        // --------------------------------------------------------------------
+        // the NUMA node whose stacks a pool region belongs to
+        // (always 0 unless the pool is NUMA aware)
+        inline void set_numa_node(uint32_t node)
+        {
+            numa_node_ = node;
+        }
+
+        inline uint32_t get_numa_node() const
+        {
+            return numa_node_;
+        }
+
         // --------------------------------------------------------------------
         // Get the local descriptor of the memory region.
-        virtual void* get_local_key(void) const = 0;
+        // The descriptor and key are captured when the memory is registered
+        // (and shared by all the chunks of a pool slab), so these are loads
+        inline void* get_local_key(void) const
+        {
+            return keys_->local_key_;
+        }
 
         // --------------------------------------------------------------------
         // Get the remote key of the memory region.
-        virtual uint64_t get_remote_key(void) const = 0;
+        inline uint64_t get_remote_key(void) const
+        {
+            return keys_->remote_key_;
+        }
 
         // --------------------------------------------------------------------
         friend std::ostream& operator<<(
@@ -150,33 +293,62 @@ namespace alloctools { namespace rma {
             os << "region " << alloctools::debug::ptr(&region) << " base address "
                << alloctools::debug::ptr(region.base_addr_) << " address "
                << alloctools::debug::ptr(region.address_) << " flags "
-               << alloctools::debug::hex<2>(region.flags_) << " size "
-               << alloctools::debug::hex<6>(region.size_) << " used_space "
+               << alloctools::debug::hex<2>(uint32_t(region.flags_)) << " size "
+               << alloctools::debug::hex<6>(uint64_t(region.size_)) << " used_space "
                << alloctools::debug::hex<6>(region.used_space_) << " local key "
                << alloctools::debug::ptr(region.get_local_key()) << " remote key "
                << alloctools::debug::ptr(region.get_remote_key());
             return os;
         }
 
+    protected:
+        // the keys of regions that are not registered
+        static region_keys* no_keys()
+        {
+            static region_keys keys = {nullptr, 0};
+            return &keys;
+        }
+
     public:
+        // The fields are ordered so that those used by pool push/pop and to
+        // build RMA requests come first (after the vtable pointer), they are
+        // packed so that a memory_region_impl fits in one 64 byte cache line
+
+        // link used while a pool region is on a free list (intrusive_stack)
+        std::atomic<memory_region*> next_;
+
         // we may be a piece of a larger region, this gives the start address
         // of this piece of the region. This is the address that should be used for data
         // storage
         char* address_;
 
-        // if we are part of a larger region, this is the base address of
-        // that larger region
-        char* base_addr_;
-
         // The size of the memory buffer, if this is a partial region
         // it will be smaller than the value returned by region_->length
-        uint64_t size_;
+        // (regions are limited to 16TB)
+        uint64_t size_ : 44;
+
+        // flags to control lifetime of blocks
+        uint64_t flags_ : 12;
+
+        // pool size class, so that release does not need to search by size
+        uint64_t size_class_ : 8;
 
         // space used by a message in the memory region.
-        uint64_t used_space_;
+        uint32_t used_space_;
 
-        // flags to control lifetime of blocks
-        uint32_t flags_;
+        // slab within the size class that a pool region belongs to
+        uint32_t slab_index_ : 24;
+
+        // NUMA node index of the stacks that a pool region is returned to
+        uint32_t numa_node_ : 8;
+
+        // registration descriptor and key, owned by the registered region
+        // (BLOCK_KEYS) and shared by the partial regions inside it
+        region_keys* keys_;
+
+        // if we are part of a larger region, this is the base address of
+        // that larger region
+        char* base_addr_;
     };
 
 }}    // namespace alloctools::rma
@@ -10,12 +10,17 @@
  */
 #pragma once
 
+#include <alloctools/alloctools_fwd.hpp>
 #include <alloctools/detail/memory_region_impl.hpp>
 #include <alloctools/memory_pool.hpp>
 #include <alloctools/memory_region.hpp>
 #include <alloctools/memory_region_pointer.hpp>
 //
+#include <cstddef>
+#include <limits>
 #include <memory>
+#include <new>
+#include <type_traits>
 
 namespace alloctools { namespace rma  {
 
@@ -55,7 +60,14 @@ namespace alloctools { namespace rma  {
     // clang-format on
 #undef DEFINE_OPERATOR
 
-    template <class T>
+    // --------------------------------------------------------------------
+    // An allocator bound to one pool, the pool pointer is part of each
+    // instance (allocators that use different pools compare unequal).
+    // When Pool is a concrete memory_pool, allocate/deallocate call the
+    // pool directly and inline into the size class stacks, the default
+    // memory_pool_base goes through its virtual interface instead.
+    // --------------------------------------------------------------------
+    template <class T, class Pool>
     struct memory_region_allocator
     {
         using value_type = T;
@@ -73,53 +85,65 @@ namespace alloctools { namespace rma  {
             typename std::pointer_traits<pointer>::difference_type;
         using size_type = std::make_unsigned_t<difference_type>;
 
+        // containers take the pool with them when they are copied/moved
+        using propagate_on_container_copy_assignment = std::true_type;
+        using propagate_on_container_move_assignment = std::true_type;
+        using propagate_on_container_swap = std::true_type;
+        using is_always_equal = std::false_type;
+
         template <class U>
         struct rebind
         {
-            typedef memory_region_allocator<U> other;
+            typedef memory_region_allocator<U, Pool> other;
         };
         // ------------------------------------
 
         // --------------------------------------------------
-        // mempool and region types are specific to transport layer, but these
-        // are abstract base classes that can be used by all code
-        using mempool_type = memory_pool_base;
+        // region types are specific to transport layer, but this is the
+        // abstract base class that can be used by all code
+        using mempool_type = Pool;
         using region_type = rma::memory_region;
 
-        // all allocators share the same mempool
-        static mempool_type* mempool_ptr;
-
         // --------------------------------------------------
-        // default constructor
-        memory_region_allocator() noexcept {}
+        // an allocator without a pool must be given one before use
+        memory_region_allocator() noexcept
+          : mempool_ptr_(nullptr)
+        {
+        }
 
-        // --------------------------------------------------
-        // default copy constructor
-        template <typename U>
-        memory_region_allocator(memory_region_allocator<U> const&) noexcept
+        explicit memory_region_allocator(mempool_type* mempool) noexcept
+          : mempool_ptr_(mempool)
         {
         }
 
         // --------------------------------------------------
-        // default move constructor
+        // copy from an allocator of another type (same pool)
         template <typename U>
-        memory_region_allocator(memory_region_allocator<U>&&) noexcept
+        memory_region_allocator(
+            memory_region_allocator<U, Pool> const& other) noexcept
+          : mempool_ptr_(other.get_memory_pool())
         {
         }
 
         void set_memory_pool(mempool_type* mempool) noexcept
         {
-            mempool_ptr = mempool;
+            mempool_ptr_ = mempool;
         }
 
-        mempool_type* get_memory_pool() noexcept
+        mempool_type* get_memory_pool() const noexcept
         {
-            return mempool_ptr;
+            return mempool_ptr_;
         }
 
+        // --------------------------------------------------
+        // n is a number of elements, the region holds n*sizeof(T) bytes
         [[nodiscard]] pointer allocate(std::size_t n)
         {
-            region_type* region = mempool_ptr->get_region(n);
+            if (n > max_size())
+            {
+                throw std::bad_alloc();
+            }
+            region_type* region = get_region(mempool_ptr_, n * sizeof(T));
             pointer p = pointer{
                 reinterpret_cast<T*>(region->get_address()), region};
             return p;
@@ -127,12 +151,17 @@ namespace alloctools { namespace rma  {
 
         void deallocate(pointer p, std::size_t)
         {
-            mempool_ptr->release_region(p.region_);
+            release_region(mempool_ptr_, p.region_);
         }
 
         void deallocate(pointer p)
         {
-            mempool_ptr->release_region(p.region_);
+            release_region(mempool_ptr_, p.region_);
+        }
+
+        std::size_t max_size() const noexcept
+        {
+            return (std::numeric_limits<std::size_t>::max)() / sizeof(T);
         }
 
         template <typename U>
@@ -147,25 +176,47 @@ namespace alloctools { namespace rma  {
         {
             ::new (static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
         }
+
+    private:
+        // --------------------------------------------------
+        // the templates are the better match for concrete pool types,
+        // only memory_pool_base itself uses the virtual functions
+        static region_type* get_region(memory_pool_base* mempool, std::size_t bytes)
+        {
+            return mempool->get_region(bytes);
+        }
+
+        template <typename P>
+        static region_type* get_region(P* mempool, std::size_t bytes)
+        {
+            return mempool->allocate_region(bytes);
+        }
+
+        static void release_region(memory_pool_base* mempool, region_type* region)
+        {
+            mempool->release_region(region);
+        }
+
+        template <typename P>
+        static void release_region(P* mempool, region_type* region)
+        {
+            mempool->deallocate(region);
+        }
+
+        mempool_type* mempool_ptr_;
     };
 
-    template <class T, class U>
-    bool operator==(const memory_region_allocator<T>&,
-        const memory_region_allocator<U>&)
+    template <class T, class U, class Pool>
+    bool operator==(const memory_region_allocator<T, Pool>& lhs,
+        const memory_region_allocator<U, Pool>& rhs)
     {
-        return true;
+        return lhs.get_memory_pool() == rhs.get_memory_pool();
     }
-    template <class T, class U>
-    bool operator!=(const memory_region_allocator<T>&,
-        const memory_region_allocator<U>&)
+    template <class T, class U, class Pool>
+    bool operator!=(const memory_region_allocator<T, Pool>& lhs,
+        const memory_region_allocator<U, Pool>& rhs)
     {
-        return false;
+        return !(lhs == rhs);
     }
 
 }}    // namespace alloctools::rma
-
-namespace alloctools { namespace rma {
-    template <typename T>
-    typename memory_region_allocator<T>::mempool_type*
-        memory_region_allocator<T>::mempool_ptr = nullptr;
-}}    // namespace alloctools::rma
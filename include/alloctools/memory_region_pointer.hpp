@@ -10,8 +10,6 @@
  */
 #pragma once
 
-#include <alloctools/detail/memory_region_impl.hpp>
-#include <alloctools/memory_pool.hpp>
 #include <alloctools/memory_region.hpp>
 //
 #include <memory>
@@ -0,0 +1,147 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+#include <alloctools/memory_pool.hpp>
+#include <alloctools/memory_region.hpp>
+//
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define ALLOCTOOLS_HAVE_MEMORY_RESOURCE
+#endif
+#endif
+
+#ifdef ALLOCTOOLS_HAVE_MEMORY_RESOURCE
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> pmr_deb("PMR    ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // A std::pmr::memory_resource that hands out registered memory from a
+    // memory_pool, so that pmr containers can be filled with memory that
+    // can be sent without copying.
+    //
+    // Every allocation is one region of the pool, marked as a resource
+    // region while it is handed out. The owning region of a pointer is
+    // found again through the pool's page map (on deallocate or when the
+    // RMA keys are needed), so no lock is taken. Pointers that are not in
+    // a resource region of the pool are rejected with std::invalid_argument.
+    // Alignments larger than the natural alignment of chunks are met by
+    // over-allocating and aligning inside the region. The pool must outlive
+    // the resource.
+    // --------------------------------------------------------------------
+    template <typename Pool>
+    class memory_region_resource : public std::pmr::memory_resource
+    {
+    public:
+        using mempool_type = Pool;
+        using region_type = memory_region;
+
+        explicit memory_region_resource(mempool_type* mempool) noexcept
+          : mempool_ptr_(mempool)
+        {
+        }
+
+        mempool_type* get_memory_pool() const noexcept
+        {
+            return mempool_ptr_;
+        }
+
+        // --------------------------------------------------------------------
+        // the region holding memory returned by a resource of the pool
+        // (interior pointers are fine), nullptr for memory that did not
+        // come from one
+        region_type* region(void const* p) const
+        {
+            region_type* r = mempool_ptr_->region_from_address(p);
+            return (r != nullptr && r->get_resource_region()) ? r : nullptr;
+        }
+
+        void* get_local_key(void const* p) const
+        {
+            return checked_region(p)->get_local_key();
+        }
+
+        uint64_t get_remote_key(void const* p) const
+        {
+            return checked_region(p)->get_remote_key();
+        }
+
+    protected:
+        // --------------------------------------------------------------------
+        void* do_allocate(std::size_t bytes, std::size_t alignment) override
+        {
+            std::size_t padding =
+                (alignment > alignof(std::max_align_t)) ? alignment - 1 : 0;
+            region_type* region = mempool_ptr_->allocate_region(bytes + padding);
+            region->set_resource_region(true);
+            std::uintptr_t address =
+                reinterpret_cast<std::uintptr_t>(region->get_address());
+            address = (address + (alignment - 1)) & ~std::uintptr_t(alignment - 1);
+            GHEX_DP_ONLY(pmr_deb,
+                trace(alloctools::debug::str<>("allocate"),
+                    alloctools::debug::ptr(address), alloctools::debug::hex<6>(bytes),
+                    "align", alloctools::debug::dec<>(alignment)));
+            return reinterpret_cast<void*>(address);
+        }
+
+        // --------------------------------------------------------------------
+        void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+        {
+            (void) bytes;
+            (void) alignment;
+            region_type* region = checked_region(p);
+            region->set_resource_region(false);
+            GHEX_DP_ONLY(pmr_deb,
+                trace(alloctools::debug::str<>("deallocate"),
+                    alloctools::debug::ptr(p), alloctools::debug::hex<6>(bytes)));
+            mempool_ptr_->deallocate(region);
+        }
+
+        // --------------------------------------------------------------------
+        // resources are interchangeable when they use the same pool
+        bool do_is_equal(std::pmr::memory_resource const& other) const
+            noexcept override
+        {
+            auto* r = dynamic_cast<memory_region_resource const*>(&other);
+            return r != nullptr && r->mempool_ptr_ == mempool_ptr_;
+        }
+
+    private:
+        // --------------------------------------------------------------------
+        region_type* checked_region(void const* p) const
+        {
+            region_type* r = region(p);
+            if (r == nullptr)
+            {
+                throw std::invalid_argument(
+                    "memory_region_resource: no region holds this pointer, "
+                    "it was not allocated by a resource of this pool");
+            }
+            return r;
+        }
+
+        mempool_type* mempool_ptr_;
+    };
+
+}}    // namespace alloctools::rma
+
+#endif
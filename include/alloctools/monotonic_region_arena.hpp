@@ -0,0 +1,187 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+#include <alloctools/detail/backing_store.hpp>
+#include <alloctools/detail/memory_block_allocator.hpp>
+#include <alloctools/detail/memory_region_impl.hpp>
+#include <alloctools/memory_region.hpp>
+//
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <new>
+#include <vector>
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> arena_deb("ARENA  ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // A registered arena for memory that lives for one phase of a program
+    // (the send buffers of one timestep for example).
+    //
+    // Regions are bump allocated out of registered blocks and are partial
+    // regions that carry the keys of their block. They are not released
+    // one at a time, reset() makes all of them free at once in constant
+    // time and keeps the blocks (and region descriptors) for the next phase.
+    // When a block is full the arena moves on to the next one, registering
+    // a new block of block_size bytes (or more, for a larger request) when
+    // all blocks are used. release() deregisters every block.
+    //
+    // The arena is not thread safe, and its regions must not be returned
+    // to a memory_pool.
+    // --------------------------------------------------------------------
+    template <typename RegionProvider>
+    class monotonic_region_arena
+    {
+    public:
+        using domain_type = typename RegionProvider::provider_domain;
+        using region_type = memory_region;
+        using region_type_impl = detail::memory_region_impl<RegionProvider>;
+        using allocator_type = detail::memory_block_allocator<RegionProvider>;
+        using block_ptr = typename allocator_type::region_ptr;
+
+        monotonic_region_arena(domain_type* pd, std::size_t block_size,
+            int numa_node = -1, page_policy policy = page_policy::heap)
+          : pd_(pd)
+          , block_size_(block_size)
+          , numa_node_(numa_node)
+          , page_policy_(policy)
+          , current_(0)
+          , offset_(0)
+          , regions_used_(0)
+          , bytes_used_(0)
+        {
+        }
+
+        monotonic_region_arena(monotonic_region_arena const&) = delete;
+        monotonic_region_arena& operator=(monotonic_region_arena const&) = delete;
+
+        // --------------------------------------------------------------------
+        // a region of length bytes whose address is a multiple of alignment
+        // (a power of two), valid until the next reset
+        region_type* allocate(std::size_t length, std::size_t alignment = 64)
+        {
+            std::uintptr_t address = 0;
+            while (current_ < blocks_.size())
+            {
+                address = fit(*blocks_[current_], length, alignment);
+                if (address != 0)
+                    break;
+                ++current_;
+                offset_ = 0;
+            }
+            if (current_ == blocks_.size())
+            {
+                blocks_.push_back(allocator_type::malloc(pd_,
+                    (std::max)(block_size_, length + alignment), numa_node_,
+                    page_policy_));
+                offset_ = 0;
+                GHEX_DP_ONLY(arena_deb,
+                    debug(alloctools::debug::str<>("new block"),
+                        *blocks_.back(), "blocks",
+                        alloctools::debug::dec<>(blocks_.size())));
+                address = fit(*blocks_.back(), length, alignment);
+            }
+            region_type_impl& block = *blocks_[current_];
+            offset_ = address + length -
+                reinterpret_cast<std::uintptr_t>(block.get_address());
+            bytes_used_ += length;
+            return make_region(block, reinterpret_cast<char*>(address), length);
+        }
+
+        // --------------------------------------------------------------------
+        // free every region given out since the last reset, O(1)
+        void reset()
+        {
+            current_ = 0;
+            offset_ = 0;
+            regions_used_ = 0;
+            bytes_used_ = 0;
+        }
+
+        // --------------------------------------------------------------------
+        // reset and deregister/free all blocks
+        void release()
+        {
+            reset();
+            regions_.clear();
+            blocks_.clear();
+        }
+
+        // --------------------------------------------------------------------
+        // bytes given out since the last reset, and bytes registered
+        std::size_t bytes_used() const
+        {
+            return bytes_used_;
+        }
+
+        std::size_t capacity() const
+        {
+            std::size_t bytes = 0;
+            for (auto const& block : blocks_)
+            {
+                bytes += block->get_size();
+            }
+            return bytes;
+        }
+
+    private:
+        // --------------------------------------------------------------------
+        // the aligned address of length bytes after the current offset of
+        // block, or 0 if they do not fit
+        std::uintptr_t fit(
+            region_type_impl const& block, std::size_t length, std::size_t alignment)
+        {
+            std::uintptr_t base = reinterpret_cast<std::uintptr_t>(block.get_address());
+            std::uintptr_t address =
+                (base + offset_ + alignment - 1) & ~std::uintptr_t(alignment - 1);
+            return (address + length <= base + block.get_size()) ? address : 0;
+        }
+
+        // --------------------------------------------------------------------
+        // descriptors are kept across resets and rebuilt in place
+        region_type* make_region(
+            region_type_impl const& block, char* address, std::size_t length)
+        {
+            if (regions_used_ == regions_.size())
+            {
+                regions_.emplace_back(
+                    block, address, length, region_type::BLOCK_PARTIAL);
+                return &regions_[regions_used_++];
+            }
+            region_type_impl* region = &regions_[regions_used_++];
+            region->~region_type_impl();
+            return new (region)
+                region_type_impl(block, address, length, region_type::BLOCK_PARTIAL);
+        }
+
+        domain_type* pd_;
+        std::size_t block_size_;
+        int numa_node_;
+        page_policy page_policy_;
+        // registered blocks, the one allocated from and the bump offset in it
+        std::vector<block_ptr> blocks_;
+        std::size_t current_;
+        std::uintptr_t offset_;
+        // region descriptors, a deque so that they never move
+        std::deque<region_type_impl> regions_;
+        std::size_t regions_used_;
+        std::size_t bytes_used_;
+    };
+
+}}    // namespace alloctools::rma
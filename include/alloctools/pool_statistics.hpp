@@ -0,0 +1,201 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // counters of one memory_pool_stack (one size class on one node)
+    // --------------------------------------------------------------------
+    struct size_class_stats
+    {
+        std::size_t size_class = 0;
+        // -1 when the pool is not NUMA aware
+        int numa_node = -1;
+        std::size_t chunk_size = 0;
+        // chunks on the shared free list, and all others (handed out or
+        // held in thread caches)
+        std::size_t free_chunks = 0;
+        std::size_t used_chunks = 0;
+        // pops from the stack, only counted when performance counters are
+        // enabled (see pool_statistics::performance_counters)
+        std::size_t accesses = 0;
+        // slabs currently held, and bytes of registered memory in them
+        std::size_t slabs = 0;
+        std::size_t registered_bytes = 0;
+        // allocations that found the stack empty, slabs added by growing
+        // the stack and slabs released by trimming
+        std::size_t slow_path_count = 0;
+        std::size_t grow_count = 0;
+        std::size_t slab_releases = 0;
+    };
+
+    // --------------------------------------------------------------------
+    // A snapshot of the counters of a memory_pool. Every counter is read
+    // with a relaxed atomic load while other threads keep allocating, so
+    // the values are individually accurate but not mutually consistent
+    // (free + used may briefly differ from the chunks of the slabs).
+    // --------------------------------------------------------------------
+    struct pool_statistics
+    {
+        std::vector<size_class_stats> classes;
+        // false when performance counters are compiled out, the accesses of
+        // the size classes are then not counted and are not written
+        bool performance_counters = false;
+        std::size_t registered_bytes = 0;
+        // regions registered on the fly (allocate_temporary_region and
+        // register_temporary_region) that are currently alive
+        std::size_t temp_regions = 0;
+        // registered memory of the small object heaps, and of the large
+        // object arena and the part of it in use (0 when not enabled)
+        std::size_t small_object_bytes = 0;
+        std::size_t large_arena_bytes = 0;
+        std::size_t large_arena_used_bytes = 0;
+    };
+
+    namespace detail {
+        // ------------------------------------------------------------------
+        // one Prometheus metric: a HELP and TYPE line, then one sample per
+        // size class (with labels) or a single pool wide sample
+        template <typename F>
+        void write_prometheus_metric(std::ostream& os, pool_statistics const& stats,
+            std::string const& name, const char* type, const char* help,
+            std::string const& labels, F&& value)
+        {
+            os << "# HELP " << name << " " << help << "\n";
+            os << "# TYPE " << name << " " << type << "\n";
+            for (auto const& c : stats.classes)
+            {
+                os << name << "{size_class=\"" << c.size_class
+                   << "\",chunk_size=\"" << c.chunk_size << "\"";
+                if (c.numa_node >= 0)
+                {
+                    os << ",numa_node=\"" << c.numa_node << "\"";
+                }
+                if (!labels.empty())
+                {
+                    os << "," << labels;
+                }
+                os << "} " << value(c) << "\n";
+            }
+        }
+
+        inline void write_prometheus_value(std::ostream& os,
+            std::string const& name, const char* help, std::string const& labels,
+            std::size_t value)
+        {
+            os << "# HELP " << name << " " << help << "\n";
+            os << "# TYPE " << name << " gauge\n";
+            os << name;
+            if (!labels.empty())
+            {
+                os << "{" << labels << "}";
+            }
+            os << " " << value << "\n";
+        }
+    }    // namespace detail
+
+    // --------------------------------------------------------------------
+    // write a snapshot as a JSON object
+    // --------------------------------------------------------------------
+    inline void write_json(std::ostream& os, pool_statistics const& stats)
+    {
+        os << "{\"registered_bytes\":" << stats.registered_bytes
+           << ",\"temp_regions\":" << stats.temp_regions
+           << ",\"small_object_bytes\":" << stats.small_object_bytes
+           << ",\"large_arena_bytes\":" << stats.large_arena_bytes
+           << ",\"large_arena_used_bytes\":" << stats.large_arena_used_bytes
+           << ",\"size_classes\":[";
+        for (std::size_t i = 0; i < stats.classes.size(); ++i)
+        {
+            size_class_stats const& c = stats.classes[i];
+            os << (i == 0 ? "" : ",") << "{\"size_class\":" << c.size_class
+               << ",\"numa_node\":" << c.numa_node
+               << ",\"chunk_size\":" << c.chunk_size
+               << ",\"free_chunks\":" << c.free_chunks
+               << ",\"used_chunks\":" << c.used_chunks;
+            if (stats.performance_counters)
+            {
+                os << ",\"accesses\":" << c.accesses;
+            }
+            os << ",\"slabs\":" << c.slabs
+               << ",\"registered_bytes\":" << c.registered_bytes
+               << ",\"slow_path_count\":" << c.slow_path_count
+               << ",\"grow_count\":" << c.grow_count
+               << ",\"slab_releases\":" << c.slab_releases << "}";
+        }
+        os << "]}";
+    }
+
+    // --------------------------------------------------------------------
+    // write a snapshot in the Prometheus text exposition format, metric
+    // names start with prefix and labels (e.g. pool="send") are added to
+    // every sample so that several pools can be exported together
+    // --------------------------------------------------------------------
+    inline void write_prometheus(std::ostream& os, pool_statistics const& stats,
+        std::string const& prefix = "alloctools_pool",
+        std::string const& labels = std::string())
+    {
+        using detail::write_prometheus_metric;
+        using detail::write_prometheus_value;
+        // clang-format off
+        write_prometheus_metric(os, stats, prefix + "_free_chunks", "gauge",
+            "Chunks on the free list of a size class", labels,
+            [](size_class_stats const& c) { return c.free_chunks; });
+        write_prometheus_metric(os, stats, prefix + "_used_chunks", "gauge",
+            "Chunks of a size class not on its free list", labels,
+            [](size_class_stats const& c) { return c.used_chunks; });
+        write_prometheus_metric(os, stats, prefix + "_slabs", "gauge",
+            "Registered slabs of a size class", labels,
+            [](size_class_stats const& c) { return c.slabs; });
+        write_prometheus_metric(os, stats, prefix + "_class_registered_bytes", "gauge",
+            "Registered bytes held by a size class", labels,
+            [](size_class_stats const& c) { return c.registered_bytes; });
+        if (stats.performance_counters)
+        {
+            write_prometheus_metric(os, stats, prefix + "_accesses_total", "counter",
+                "Chunks popped from a size class", labels,
+                [](size_class_stats const& c) { return c.accesses; });
+        }
+        write_prometheus_metric(os, stats, prefix + "_slow_path_total", "counter",
+            "Allocations that found a size class empty", labels,
+            [](size_class_stats const& c) { return c.slow_path_count; });
+        write_prometheus_metric(os, stats, prefix + "_grow_total", "counter",
+            "Slabs added to a size class", labels,
+            [](size_class_stats const& c) { return c.grow_count; });
+        write_prometheus_metric(os, stats, prefix + "_slab_releases_total", "counter",
+            "Slabs released by trimming a size class", labels,
+            [](size_class_stats const& c) { return c.slab_releases; });
+        write_prometheus_value(os, prefix + "_registered_bytes",
+            "Registered bytes held by the size classes", labels,
+            stats.registered_bytes);
+        write_prometheus_value(os, prefix + "_temp_regions",
+            "Regions registered on the fly that are alive", labels,
+            stats.temp_regions);
+        write_prometheus_value(os, prefix + "_small_object_bytes",
+            "Registered bytes of the small object heaps", labels,
+            stats.small_object_bytes);
+        write_prometheus_value(os, prefix + "_large_arena_bytes",
+            "Registered bytes of the large object arena", labels,
+            stats.large_arena_bytes);
+        write_prometheus_value(os, prefix + "_large_arena_used_bytes",
+            "Bytes of the large object arena in use", labels,
+            stats.large_arena_used_bytes);
+        // clang-format on
+    }
+
+}}    // namespace alloctools::rma
@@ -0,0 +1,267 @@
+/*
+ * AllocTools
+ *
+ * Copyright (c) 2017-2021, ETH Zurich
+ * All rights reserved.
+ *
+ * Please, refer to the LICENSE file in the root directory.
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+#pragma once
+
+#include <alloctools/debugging/print.hpp>
+#include <alloctools/detail/backing_store.hpp>
+#include <alloctools/detail/memory_block_allocator.hpp>
+#include <alloctools/detail/memory_region_impl.hpp>
+#include <alloctools/memory_region.hpp>
+//
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+#if defined(ALLOCTOOLS_HAVE_MMAP) && defined(MFD_CLOEXEC)
+#include <fcntl.h>
+#include <unistd.h>
+#define ALLOCTOOLS_HAVE_MEMFD
+#endif
+
+namespace alloctools {
+    // cppcheck-suppress ConfigurationNotChecked
+    static alloctools::debug::enable_print<false> ring_deb("RING   ");
+}    // namespace alloctools
+
+namespace alloctools { namespace rma {
+
+    // --------------------------------------------------------------------
+    // A ring of registered memory for buffers that are freed in the order
+    // they were allocated (streaming sends).
+    //
+    // Regions are contiguous partial regions of one registration, allocation
+    // moves the head of the ring and release moves the tail, there is no
+    // other bookkeeping. A region may be released before older ones, the
+    // tail then only moves once all older regions have been released too.
+    //
+    // When double_map is set the ring memory is a memfd that is mapped twice
+    // back to back (and registered as one range), a record that runs past
+    // the end of the ring continues in the second mapping, so records never
+    // have to be split or padded at the wrap. Without memfd support, or if
+    // mapping fails, a single registered block is used and a record that
+    // does not fit before the end starts again at the beginning.
+    //
+    // At most max_records regions can be outstanding. allocate returns
+    // nullptr when the ring (or the record limit) is full, the caller
+    // must then wait for completions. One thread may allocate while one
+    // other thread releases.
+    // --------------------------------------------------------------------
+    template <typename RegionProvider>
+    class ring_region_allocator
+    {
+    public:
+        using domain_type = typename RegionProvider::provider_domain;
+        using region_type = memory_region;
+        using region_type_impl = detail::memory_region_impl<RegionProvider>;
+        using allocator_type = detail::memory_block_allocator<RegionProvider>;
+        using block_ptr = typename allocator_type::region_ptr;
+
+        // ------------------------------------------------------------------
+        // bytes is rounded up to whole pages
+        ring_region_allocator(domain_type* pd, std::size_t bytes,
+            std::size_t max_records, bool double_map = true,
+            std::size_t alignment = 64)
+          : alignment_(alignment)
+          , mapping_(nullptr)
+          , records_(nullptr)
+          , max_records_((std::max)(max_records, std::size_t(1)))
+          , head_(0)
+          , record_head_(0)
+          , tail_(0)
+          , record_tail_(0)
+        {
+            std::size_t page = std::size_t(sysconf(_SC_PAGESIZE));
+            size_ = (bytes + page - 1) & ~(page - 1);
+            if (double_map)
+            {
+                mapping_ = map_twice(size_);
+            }
+            if (mapping_ != nullptr)
+            {
+                // one registration covers both views of the memory
+                block_.reset(new region_type_impl(pd, mapping_, 2 * size_));
+            }
+            else
+            {
+                block_ = allocator_type::malloc(pd, size_);
+            }
+            base_ = reinterpret_cast<std::uintptr_t>(block_->get_address());
+            records_ = new record[max_records_];
+            for (std::size_t i = 0; i < max_records_; ++i)
+            {
+                records_[i].region_.~region_type_impl();
+                new (&records_[i].region_) region_type_impl(*block_,
+                    block_->get_address(), 0, region_type::BLOCK_PARTIAL);
+                records_[i].region_.set_slab_index(uint32_t(i));
+            }
+            GHEX_DP_ONLY(ring_deb,
+                debug(alloctools::debug::str<>("ring"),
+                    alloctools::debug::ptr(base_), alloctools::debug::hex<8>(size_),
+                    "double mapped", alloctools::debug::dec<>(double_mapped())));
+        }
+
+        ~ring_region_allocator()
+        {
+            delete[] records_;
+            block_.reset();
+#ifdef ALLOCTOOLS_HAVE_MEMFD
+            if (mapping_ != nullptr)
+            {
+                ::munmap(mapping_, 2 * size_);
+            }
+#endif
+        }
+
+        ring_region_allocator(ring_region_allocator const&) = delete;
+        ring_region_allocator& operator=(ring_region_allocator const&) = delete;
+
+        // ------------------------------------------------------------------
+        // a region of length bytes, nullptr if the ring is full
+        region_type* allocate(std::size_t length)
+        {
+            std::uint64_t tail = tail_.load(std::memory_order_acquire);
+            std::uint64_t record_tail = record_tail_.load(std::memory_order_acquire);
+            std::uint64_t record_head = record_head_.load(std::memory_order_relaxed);
+            if (length > size_ || record_head - record_tail == max_records_)
+                return nullptr;
+            std::uint64_t start = head_.load(std::memory_order_relaxed);
+            std::uint64_t offset = start % size_;
+            if (mapping_ == nullptr && offset + length > size_)
+            {
+                // skip the end of the ring, the record starts at the beginning
+                start += size_ - offset;
+                offset = 0;
+            }
+            std::uint64_t end = start + length;
+            end = (end + alignment_ - 1) & ~std::uint64_t(alignment_ - 1);
+            if (end - tail > size_)
+            {
+                GHEX_DP_ONLY(ring_deb,
+                    trace(alloctools::debug::str<>("full"),
+                        alloctools::debug::hex<8>(length)));
+                return nullptr;
+            }
+            record& r = records_[record_head % max_records_];
+            r.end_ = end;
+            r.done_.store(false, std::memory_order_relaxed);
+            r.region_.address_ = reinterpret_cast<char*>(base_ + offset);
+            r.region_.size_ = length;
+            head_.store(end, std::memory_order_release);
+            record_head_.store(record_head + 1, std::memory_order_release);
+            return &r.region_;
+        }
+
+        // ------------------------------------------------------------------
+        // give a region back, the space is reused once every region
+        // allocated before it has been released as well
+        void release(region_type* region)
+        {
+            records_[region->get_slab_index()].done_.store(
+                true, std::memory_order_relaxed);
+            std::uint64_t record_tail = record_tail_.load(std::memory_order_relaxed);
+            std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+            std::uint64_t record_head = record_head_.load(std::memory_order_acquire);
+            while (record_tail != record_head)
+            {
+                record& r = records_[record_tail % max_records_];
+                if (!r.done_.load(std::memory_order_relaxed))
+                    break;
+                tail = r.end_;
+                ++record_tail;
+            }
+            tail_.store(tail, std::memory_order_release);
+            record_tail_.store(record_tail, std::memory_order_release);
+        }
+
+        // ------------------------------------------------------------------
+        std::size_t size() const
+        {
+            return size_;
+        }
+
+        bool double_mapped() const
+        {
+            return mapping_ != nullptr;
+        }
+
+        // bytes between the tail and the head (including padding)
+        std::size_t bytes_in_use() const
+        {
+            std::uint64_t tail = tail_.load(std::memory_order_acquire);
+            return std::size_t(head_.load(std::memory_order_acquire) - tail);
+        }
+
+    private:
+        struct record
+        {
+            region_type_impl region_;
+            std::uint64_t end_;
+            std::atomic<bool> done_;
+        };
+
+        // ------------------------------------------------------------------
+        // reserve 2*length of address space and map the same memfd into
+        // both halves, returns nullptr if that is not possible
+        static void* map_twice(std::size_t length)
+        {
+#ifdef ALLOCTOOLS_HAVE_MEMFD
+            int fd = ::memfd_create("alloctools_ring", MFD_CLOEXEC);
+            if (fd < 0)
+                return nullptr;
+            void* result = nullptr;
+            if (::ftruncate(fd, off_t(length)) == 0)
+            {
+                void* addr = ::mmap(nullptr, 2 * length, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (addr != MAP_FAILED)
+                {
+                    char* lo = static_cast<char*>(addr);
+                    if (::mmap(lo, length, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+                        ::mmap(lo + length, length, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED)
+                    {
+                        result = addr;
+                    }
+                    else
+                    {
+                        ::munmap(addr, 2 * length);
+                    }
+                }
+            }
+            ::close(fd);
+            return result;
+#else
+            (void) length;
+            return nullptr;
+#endif
+        }
+
+        std::size_t size_;
+        std::size_t alignment_;
+        void* mapping_;
+        block_ptr block_;
+        std::uintptr_t base_;
+        record* records_;
+        std::size_t max_records_;
+        // positions (in bytes and in records) that only grow, written by
+        // the allocating thread
+        alignas(64) std::atomic<std::uint64_t> head_;
+        std::atomic<std::uint64_t> record_head_;
+        // written by the releasing thread
+        alignas(64) std::atomic<std::uint64_t> tail_;
+        std::atomic<std::uint64_t> record_tail_;
+    };
+
+}}    // namespace alloctools::rma